@@ -24,13 +24,26 @@
 
 #pragma once
 
+#include <any>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <initializer_list>
-#include <list>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <ranges>
 #include <span>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -43,6 +56,246 @@ namespace env {
 
 } // namespace env
 
+#if defined(ARGPARSE_INSTRUMENTATION)
+namespace instrumentation {
+
+// Steps taken by the parsing loops of the calling thread, e.g. tokens
+// scanned, flags looked up and positionals matched. Only compiled in with
+// ARGPARSE_INSTRUMENTATION, for tests that check how parsing scales.
+[[nodiscard]] std::size_t Operations();
+void ResetOperations();
+
+} // namespace instrumentation
+#endif
+
+// Number of bytes, from values like "4096", "512MiB" or "10kB"
+struct ByteSize {
+  std::uint64_t bytes = 0;
+
+  auto operator<=>(const ByteSize &) const = default;
+};
+
+// Events per second, from values like "100/s" or "5/min"
+struct Rate {
+  double per_second = 0;
+
+  auto operator<=>(const Rate &) const = default;
+};
+
+// Bytes per second, from values like "10MiB/s"
+struct ByteRate {
+  double bytes_per_second = 0;
+
+  auto operator<=>(const ByteRate &) const = default;
+};
+
+// Specialized for strings, bool, int, long, float, double, ByteSize, Rate,
+// ByteRate and the std::chrono durations from nanoseconds to hours. Durations
+// take a unit such as "250ms", "1h" or "3d".
+template <typename T> [[nodiscard]] T FromString(std::string_view str);
+
+// Written so that FromString reads them back, e.g. ByteSize{1024} as "1024"
+// and std::chrono::milliseconds{250} as "250ms".
+[[nodiscard]] std::string ToString(ByteSize value);
+[[nodiscard]] std::string ToString(Rate value);
+[[nodiscard]] std::string ToString(ByteRate value);
+[[nodiscard]] std::string ToString(std::chrono::nanoseconds value);
+[[nodiscard]] std::string ToString(std::chrono::microseconds value);
+[[nodiscard]] std::string ToString(std::chrono::milliseconds value);
+[[nodiscard]] std::string ToString(std::chrono::seconds value);
+[[nodiscard]] std::string ToString(std::chrono::minutes value);
+[[nodiscard]] std::string ToString(std::chrono::hours value);
+
+// Called with the values of each occurrence of an argument. append is true
+// when earlier values of the same parse must be kept. The calls are made
+// once the whole parse has succeeded, and never for ParseLazy.
+using Binder =
+    std::function<void(std::span<const std::string_view> values, bool append)>;
+
+namespace detail {
+
+struct StringHash {
+  using is_transparent = void;
+
+  [[nodiscard]] std::size_t operator()(std::string_view str) const {
+    return std::hash<std::string_view>{}(str);
+  }
+};
+
+template <typename T> Binder MakeBinder(T *destination) {
+  return [destination](std::span<const std::string_view> values, bool) {
+    if constexpr (std::is_same_v<T, bool>) {
+      if (values.empty()) {
+        *destination = true;
+        return;
+      }
+    }
+
+    if (!values.empty()) {
+      *destination = FromString<T>(values.front());
+    }
+  };
+}
+
+template <typename T> Binder MakeBinder(std::vector<T> *destination) {
+  return [destination](std::span<const std::string_view> values,
+                       bool append) {
+    if (!append) {
+      destination->clear();
+    }
+    for (const auto &value : values) {
+      destination->push_back(FromString<T>(value));
+    }
+  };
+}
+
+// Contiguous string storage with room for N values inline. Strings keep
+// their buffers when cleared so that the storage can be refilled in place.
+template <std::size_t N> class SmallStringVector final {
+public:
+  SmallStringVector() = default;
+
+  template <typename It> SmallStringVector(It first, It last) {
+    assign(first, last);
+  }
+
+  [[nodiscard]] std::size_t size() const { return m_size; }
+  [[nodiscard]] bool empty() const { return (m_size == 0); }
+
+  [[nodiscard]] const std::string *data() const {
+    return m_on_heap ? m_heap.data() : m_inline.data();
+  }
+  [[nodiscard]] const std::string *begin() const { return data(); }
+  [[nodiscard]] const std::string *end() const { return data() + m_size; }
+  [[nodiscard]] const std::string &operator[](std::size_t index) const {
+    return data()[index];
+  }
+
+  void clear() {
+    if (m_on_heap) {
+      m_heap.clear();
+      m_on_heap = false;
+    } else {
+      for (std::size_t i = 0; i < m_size; ++i) {
+        m_inline[i].clear();
+      }
+    }
+    m_size = 0;
+  }
+
+  template <typename U> void push_back(const U &value) {
+    if (!m_on_heap && (m_size < N)) {
+      m_inline[m_size] = value;
+    } else {
+      if (!m_on_heap) {
+        m_heap.reserve(2 * N);
+        for (std::size_t i = 0; i < m_size; ++i) {
+          m_heap.push_back(std::move(m_inline[i]));
+          m_inline[i].clear();
+        }
+        m_on_heap = true;
+      }
+      m_heap.emplace_back(value);
+    }
+    ++m_size;
+  }
+
+  template <typename It> void assign(It first, It last) {
+    clear();
+    for (auto it = first; it != last; ++it) {
+      push_back(*it);
+    }
+  }
+
+private:
+  std::array<std::string, N> m_inline;
+  std::vector<std::string> m_heap;
+  std::size_t m_size = 0;
+  bool m_on_heap = false;
+};
+
+// BK-tree over a set of words for approximate lookups by edit distance.
+// The words are not copied and must outlive the tree.
+class BKTree final {
+public:
+  void Insert(std::string_view word);
+
+  // Up to max_results words within max_distance of word, closest first.
+  [[nodiscard]] std::vector<std::string_view>
+  FindClosest(std::string_view word, std::size_t max_distance,
+              std::size_t max_results) const;
+
+private:
+  struct Node {
+    std::string_view word;
+    std::vector<std::pair<std::size_t, std::size_t>> children; // {dist, node}
+  };
+
+  std::vector<Node> m_nodes;
+};
+
+// Types a default can have: a single value that can be written as a string
+// and read back with FromString. There are no list defaults.
+template <typename T>
+concept DefaultType = std::is_arithmetic_v<T> ||
+                      std::is_convertible_v<T, std::string_view> ||
+                      requires(const T &value) { argparse::ToString(value); };
+
+// Default value of an argument, kept in the type it was given in
+class DefaultValue final {
+public:
+  template <DefaultType T>
+  explicit DefaultValue(T value)
+      : m_value(std::move(value)), m_to_string(&ToString<T>) {}
+
+  // Null unless the value is of type T
+  template <typename T> [[nodiscard]] const T *Get() const {
+    return std::any_cast<T>(&m_value);
+  }
+
+  [[nodiscard]] std::string ToString() const { return m_to_string(m_value); }
+
+private:
+  std::any m_value;
+  std::string (*m_to_string)(const std::any &value);
+
+  template <typename T> static std::string ToString(const std::any &value) {
+    const T &typed = std::any_cast<const T &>(value);
+    if constexpr (std::is_same_v<T, bool>) {
+      return typed ? "true" : "false";
+    } else if constexpr (std::is_floating_point_v<T>) {
+      // Shortest form that reads back to the same value
+      std::array<char, 64> buffer;
+      const auto result =
+          std::to_chars(buffer.data(), buffer.data() + buffer.size(), typed);
+      return std::string(buffer.data(), result.ptr);
+    } else if constexpr (std::is_arithmetic_v<T>) {
+      return std::to_string(typed);
+    } else if constexpr (std::is_constructible_v<std::string, const T &>) {
+      return std::string{typed};
+    } else {
+      return argparse::ToString(typed);
+    }
+  }
+};
+
+// Default values of a parser by argument name, shared with its maps
+struct Defaults;
+
+// Definitions and parsing of an ArgumentParser, see argparse.cpp
+class ParserCore;
+
+// Let the parser owning a definition know that it is about to change
+void Touch(ParserCore *owner);
+
+// Set the default of the named arguments of the owning parser. The defaults
+// are copied first if a parse still holds them, so parses keep the defaults
+// they saw.
+void SetDefault(ParserCore *owner, std::span<const std::string> names,
+                const std::shared_ptr<const DefaultValue> &value);
+
+} // namespace detail
+
 enum class NArgs {
   NUMERIC,
   OPTIONAL,
@@ -50,11 +303,23 @@ enum class NArgs {
   ONE_OR_MORE,
 };
 
+// What to do when an optional is given more than once
+enum class Action {
+  STORE,  // Keep the values of the last occurrence
+  APPEND, // Append the values of each occurrence to one list. NArgs must be
+          // numeric, so occurrence i holds values [i * num, (i + 1) * num).
+  EXTEND, // Append the values of each occurrence, any NArgs
+  COUNT,  // Count occurrences; takes no values
+};
+
 struct Positional {
   std::string name;
   NArgs nargs = NArgs::NUMERIC; // Numeric or special
   std::size_t num_args = 1;     // Number if NArgs is numeric
   std::string help;
+  Binder binder;
+  std::shared_ptr<const detail::DefaultValue> default_value;
+  detail::ParserCore *owner = nullptr; // Set by AddPositional
 
   Positional(const std::string &name);
 
@@ -63,6 +328,15 @@ struct Positional {
   Positional &NumArgs(NArgs num);
   Positional &Help(const std::string &help);
 
+  template <typename T> Positional &Bind(T *destination) {
+    detail::Touch(owner);
+    binder = detail::MakeBinder(destination);
+    return *this;
+  }
+
+  // Single value read from the map when the positional is not given
+  template <detail::DefaultType T> Positional &Default(T value);
+
   [[nodiscard]] std::pair<NArgs, std::size_t> GetNArgs() const;
 };
 
@@ -72,6 +346,12 @@ struct Optional final {
   NArgs nargs = NArgs::NUMERIC; // Numeric or special
   std::size_t num_args = 1;     // Number if NArgs is numeric
   std::string help;
+  argparse::Action action = argparse::Action::STORE;
+  Binder binder;
+  std::shared_ptr<const detail::DefaultValue> default_value;
+  detail::ParserCore *owner = nullptr; // Set by AddOptional
+  std::size_t id = 0; // Position in the parser, set by AddOptional
+  std::string env;    // Environment variable read when not given
 
   Optional(std::initializer_list<std::string> flags);
   Optional(const std::string &flag);
@@ -81,83 +361,457 @@ struct Optional final {
   Optional &NumArgs(NArgs num);
   Optional &Required(bool req);
   Optional &Help(const std::string &help);
+  Optional &Action(argparse::Action act);
+  // Read the value from an environment variable when the option is not on
+  // the command line. Options without arguments take a boolean, counted
+  // options a count, and options with many arguments a list split on spaces.
+  Optional &Env(const std::string &variable);
+
+  template <typename T> Optional &Bind(T *destination) {
+    detail::Touch(owner);
+    binder = detail::MakeBinder(destination);
+    return *this;
+  }
+
+  // Single value read from the map when the optional is not given
+  template <detail::DefaultType T> Optional &Default(T value);
 
   [[nodiscard]] std::pair<NArgs, std::size_t> GetNArgs() const;
   [[nodiscard]] bool HasFlag(const std::string &flag) const;
 };
 
+/* Read-only view over a serialized parser definition, see
+ * ArgumentParser::Serialize. The format is versioned, position independent
+ * and read in place, so a schema embedded in the binary or mapped from a
+ * file can be used for parsing without building the definitions on the heap.
+ */
+class Schema final {
+public:
+  static constexpr std::uint32_t VERSION = 1;
+
+  struct PositionalEntry {
+    std::string_view name;
+    std::string_view help;
+    NArgs nargs = NArgs::NUMERIC;
+    std::size_t num_args = 1;
+  };
+
+  struct OptionalEntry {
+    std::size_t first_flag = 0; // Index of the first flag in the flag table
+    std::size_t num_flags = 0;
+    std::string_view help;
+    NArgs nargs = NArgs::NUMERIC;
+    std::size_t num_args = 1;
+    bool required = false;
+    argparse::Action action = argparse::Action::STORE;
+  };
+
+  // The bytes are not copied and must outlive the Schema.
+  explicit Schema(std::span<const std::byte> blob);
+  explicit Schema(std::vector<std::byte> blob);
+
+  // Map a schema file into memory, read-only.
+  [[nodiscard]] static Schema Map(const std::string &path);
+
+  [[nodiscard]] std::span<const std::byte> Bytes() const;
+  [[nodiscard]] std::string_view Description() const;
+  [[nodiscard]] bool IgnoreFirstArgument() const;
+
+  [[nodiscard]] std::size_t NumPositionals() const;
+  [[nodiscard]] PositionalEntry GetPositional(std::size_t index) const;
+
+  [[nodiscard]] std::size_t NumOptionals() const;
+  [[nodiscard]] OptionalEntry GetOptional(std::size_t index) const;
+
+  // Indices of the required optionals
+  [[nodiscard]] std::size_t NumRequired() const;
+  [[nodiscard]] std::size_t GetRequired(std::size_t index) const;
+
+  [[nodiscard]] std::size_t NumFlags() const;
+  [[nodiscard]] std::string_view GetFlag(std::size_t index) const;
+
+  // Index of the optional with this flag, by a hash table lookup.
+  [[nodiscard]] std::optional<std::size_t>
+  FindOptional(std::string_view flag) const;
+
+private:
+  std::shared_ptr<const void> m_owner;
+  std::span<const std::byte> m_blob;
+
+  [[nodiscard]] std::uint32_t ReadField(std::size_t field) const;
+  [[nodiscard]] std::uint32_t ReadU32(std::size_t offset) const;
+  [[nodiscard]] std::string_view ReadString(std::size_t offset) const;
+  [[nodiscard]] std::size_t SectionOffset(std::size_t field,
+                                          std::size_t index,
+                                          std::size_t record_size) const;
+  void Validate() const;
+};
+
+// Definition of an optional for ArgumentParser::AddOptionals. Environment
+// variables and bindings need AddOptional.
+struct OptionalSpec {
+  std::string_view flags = {};  // Separated by spaces, e.g. "-t --threads"
+  std::string_view nargs = "1"; // A number or one of "?", "*" and "+"
+  bool required = false;
+  std::string_view help = {};
+  argparse::Action action = argparse::Action::STORE;
+  // Read from the map when the optional is not given, as with Default
+  std::optional<std::string_view> default_value = {};
+};
+
 class Argument final {
 public:
   Argument(std::span<const char *> values);
   Argument(std::span<const std::string> values);
+  Argument(std::span<const std::string_view> values);
+  explicit Argument(std::shared_ptr<const detail::DefaultValue> value);
+
+  // Replace the values, reusing the existing storage.
+  void Assign(std::span<const std::string_view> values);
+  void Append(std::span<const std::string_view> values);
+  // Hold a count of occurrences as the single value.
+  void SetCount(std::size_t count);
 
   [[nodiscard]] std::size_t Size() const;
 
-  template <typename T> [[nodiscard]] T As(std::size_t index) const;
+  template <typename T> [[nodiscard]] T As(std::size_t index) const {
+    if (m_count.has_value()) {
+      if constexpr (std::is_arithmetic_v<T>) {
+        return static_cast<T>(*m_count);
+      } else {
+        return FromString<T>(std::to_string(*m_count));
+      }
+    }
+
+    if (m_default != nullptr) {
+      if (const T *value = m_default->Get<T>()) {
+        return *value;
+      }
+      return FromString<T>(m_default->ToString());
+    }
+
+    return FromString<T>(m_values[index]);
+  }
 
   template <typename T> [[nodiscard]] T As() const { return As<T>(0); }
 
-  template <typename T> [[nodiscard]] std::vector<T> AsVector() const;
+  template <typename T> [[nodiscard]] std::vector<T> AsVector() const {
+    const std::size_t size = Size();
+    std::vector<T> values;
+    values.reserve(size);
+    for (std::size_t i = 0; i < size; ++i) {
+      values.push_back(As<T>(i));
+    }
+    return values;
+  }
+
+  // Sized, random-access view that converts values as they are read.
+  template <typename T> [[nodiscard]] auto AsRange() const {
+    return std::views::iota(std::size_t{0}, Size()) |
+           std::views::transform(
+               [this](std::size_t index) { return As<T>(index); });
+  }
 
   [[nodiscard]] operator std::vector<std::string>() const;
   [[nodiscard]] std::vector<std::string> operator*() const;
 
 private:
-  std::vector<std::string> m_values;
+  friend class ArgumentMap;
+
+  detail::SmallStringVector<2> m_values;
+  std::optional<std::size_t> m_count;
+  std::shared_ptr<const detail::DefaultValue> m_default;
 };
 
+template <detail::DefaultType T> Positional &Positional::Default(T value) {
+  using Stored = std::conditional_t<std::is_convertible_v<T, std::string_view>,
+                                    std::string, T>;
+  auto stored = std::make_shared<const detail::DefaultValue>(
+      Stored{std::move(value)});
+  detail::SetDefault(owner, {&name, 1}, stored);
+  default_value = std::move(stored);
+  return *this;
+}
+
+template <detail::DefaultType T> Optional &Optional::Default(T value) {
+  using Stored = std::conditional_t<std::is_convertible_v<T, std::string_view>,
+                                    std::string, T>;
+  auto stored = std::make_shared<const detail::DefaultValue>(
+      Stored{std::move(value)});
+  detail::SetDefault(owner, flags, stored);
+  default_value = std::move(stored);
+  return *this;
+}
+
 class ArgumentMap final {
 public:
   void Add(const std::string &name, const Argument &arg);
+  void Add(std::string_view name, std::span<const std::string_view> values);
+  void Append(std::string_view name, std::span<const std::string_view> values);
+  void SetCount(std::string_view name, std::size_t count);
+
+  // Remove all arguments but keep their storage for the next parse.
+  void Clear();
 
+  // Whether the argument was given. Defaults do not count.
   [[nodiscard]] bool Contains(const std::string &name) const;
+  // The argument as given, or else its default.
   [[nodiscard]] const Argument &operator[](const std::string &name) const;
 
+  // Check all arguments of a map from ArgumentParser::ParseLazy, throwing
+  // what Parse would have thrown. Other maps are always checked.
+  void Validate() const;
+
+  // Serialize the arguments, with the defaults of the parser, to the binary
+  // format read by ArgumentView. A lazy map is validated first.
+  [[nodiscard]] std::vector<std::byte> Serialize() const;
+  // Serialize into a new anonymous memory file (a memfd, or an unlinked
+  // shared memory object where memfd is not available) and return its
+  // descriptor. It is not closed on exec, so forked and re-executed workers
+  // can map it with ArgumentView::Map. The caller closes it.
+  [[nodiscard]] int SerializeToMemory() const;
+
 private:
-  std::unordered_map<std::string, Argument> m_map;
+  friend class detail::ParserCore;
+
+  struct LazyState;
+
+  [[nodiscard]] const Argument *Find(std::string_view name,
+                                     bool with_defaults) const;
+
+  struct Entry {
+    Argument argument;
+    bool present = true;
+  };
+
+  std::unordered_map<std::string, Entry, detail::StringHash, std::equal_to<>>
+      m_map;
+  // Of the parser that filled the map, read only when an argument is missing
+  std::shared_ptr<const detail::Defaults> m_defaults;
+  // Tokens of a lazy parse, resolved as the arguments are read
+  std::shared_ptr<LazyState> m_lazy;
+};
+
+/* Read-only view over arguments serialized with ArgumentMap::Serialize. Like
+ * Schema, the format is position independent and read in place, so worker
+ * processes can share the arguments parsed by their parent, e.g. mapped from
+ * a memfd, without parsing or copying them.
+ */
+class ArgumentView final {
+public:
+  static constexpr std::uint32_t VERSION = 1;
+
+  // An argument of the view, valid while the view is.
+  class Value final {
+  public:
+    [[nodiscard]] std::size_t Size() const;
+    [[nodiscard]] std::string_view Get(std::size_t index) const;
+
+    template <typename T> [[nodiscard]] T As(std::size_t index) const {
+      if (m_count.has_value()) {
+        if constexpr (std::is_arithmetic_v<T>) {
+          return static_cast<T>(*m_count);
+        } else {
+          return FromString<T>(std::to_string(*m_count));
+        }
+      }
+      return FromString<T>(Get(index));
+    }
+
+    template <typename T> [[nodiscard]] T As() const { return As<T>(0); }
+
+    template <typename T> [[nodiscard]] std::vector<T> AsVector() const {
+      const std::size_t size = Size();
+      std::vector<T> values;
+      values.reserve(size);
+      for (std::size_t i = 0; i < size; ++i) {
+        values.push_back(As<T>(i));
+      }
+      return values;
+    }
+
+  private:
+    friend class ArgumentView;
+
+    const ArgumentView *m_view = nullptr;
+    std::size_t m_first_value = 0;
+    std::size_t m_num_values = 0;
+    std::optional<std::size_t> m_count;
+  };
+
+  // The bytes are not copied and must outlive the view.
+  explicit ArgumentView(std::span<const std::byte> blob);
+  explicit ArgumentView(std::vector<std::byte> blob);
+
+  // Map a descriptor read-only, e.g. from ArgumentMap::SerializeToMemory.
+  // The descriptor can be closed once mapped.
+  [[nodiscard]] static ArgumentView Map(int fd);
+
+  [[nodiscard]] std::span<const std::byte> Bytes() const;
+
+  // Whether the argument was given. Defaults do not count.
+  [[nodiscard]] bool Contains(std::string_view name) const;
+  // The argument as given, or else its default.
+  [[nodiscard]] Value operator[](std::string_view name) const;
+
+private:
+  std::shared_ptr<const void> m_owner;
+  std::span<const std::byte> m_blob;
+
+  // Offset of the entry of an argument, by a hash table lookup
+  [[nodiscard]] std::optional<std::size_t>
+  FindEntry(std::string_view name) const;
+  [[nodiscard]] std::uint32_t ReadField(std::size_t field) const;
+  [[nodiscard]] std::uint32_t ReadU32(std::size_t offset) const;
+  [[nodiscard]] std::string_view ReadString(std::size_t offset) const;
+  [[nodiscard]] std::size_t SectionOffset(std::size_t field,
+                                          std::size_t index,
+                                          std::size_t record_words) const;
+  void Validate() const;
+};
+
+// Immutable, reference-counted result of a parse, including the defaults it
+// was parsed with. Any number of threads can read it, and it is freed with
+// its last reference.
+using ArgumentSnapshot = std::shared_ptr<const ArgumentMap>;
+
+// Holds the current snapshot, e.g. options re-parsed on reload, and replaces
+// it atomically. An old snapshot lives on until its last reader lets go of
+// it. Load and Publish are lock-free only where std::atomic<std::shared_ptr>
+// is; libstdc++ guards it with a short internal lock.
+class SnapshotPublisher final {
+public:
+  explicit SnapshotPublisher(ArgumentSnapshot snapshot);
+
+  void Publish(ArgumentSnapshot snapshot);
+  [[nodiscard]] ArgumentSnapshot Load() const;
+  // Incremented by every publish
+  [[nodiscard]] std::uint64_t Version() const;
+
+  // Per-thread handle that keeps a reference to the snapshot it last saw.
+  // Get is a single atomic load of the version unless a new snapshot has
+  // been published, so steady-state reads never take that lock.
+  class Reader final {
+  public:
+    explicit Reader(const SnapshotPublisher &publisher);
+
+    [[nodiscard]] const ArgumentMap &Get();
+
+  private:
+    const SnapshotPublisher *m_publisher;
+    std::uint64_t m_version;
+    ArgumentSnapshot m_snapshot;
+  };
+
+private:
+  std::atomic<ArgumentSnapshot> m_snapshot;
+  std::atomic<std::uint64_t> m_version = 0;
+};
+
+struct ParseCacheStats {
+  std::size_t hits = 0;
+  std::size_t misses = 0;
 };
 
 class ArgumentParser final {
 public:
-  ArgumentParser() = default;
+  ArgumentParser();
   ArgumentParser(const std::string &description);
+  // Parse with the definitions of a schema, read in place.
+  explicit ArgumentParser(const Schema &schema);
+
+  // Copies share the definitions, so copying is O(1). The first change on
+  // either side adds a layer of its own over the shared definitions instead
+  // of copying them. References returned by AddPositional and AddOptional
+  // must not be used after copying. A moved-from parser is left empty.
+  ArgumentParser(const ArgumentParser &) = default;
+  ArgumentParser &operator=(const ArgumentParser &) = default;
+  ArgumentParser(ArgumentParser &&other) noexcept;
+  ArgumentParser &operator=(ArgumentParser &&other) noexcept;
+
+  // A parser to extend with more definitions, e.g. per thread or per plugin,
+  // leaving this parser unchanged. The definitions of this parser are shared
+  // with the fork rather than copied.
+  [[nodiscard]] ArgumentParser Fork() const;
 
   void IgnoreFirstArgument(bool ignore = true);
 
   Positional &AddPositional(const std::string &name);
   Optional &AddOptional(std::initializer_list<std::string> flags);
   Optional &AddOptional(const std::string &flag);
+  // Define many optionals from a table at once. The flags and help of all
+  // tables go to one string pool and one flag index per parser, so a table
+  // costs a few allocations however long it is.
+  void AddOptionals(std::span<const OptionalSpec> table);
+
+  // Allow at most one of the options in a parse, or exactly one if required.
+  void AddMutuallyExclusive(std::initializer_list<std::string> flags,
+                            bool required = false);
+  // Whenever the option is given, all of its dependencies must be given too.
+  void AddDependency(const std::string &flag,
+                     std::initializer_list<std::string> dependencies);
 
   [[nodiscard]] const ArgumentMap Parse(int argc, const char *argv[]);
   [[nodiscard]] const ArgumentMap Parse(std::span<const char *> args);
   [[nodiscard]] const ArgumentMap Parse(std::span<const std::string> args);
-
+  // Split a single command line with POSIX shell quoting and parse it.
+  [[nodiscard]] const ArgumentMap Parse(std::string_view line);
+
+  // Parse into an existing map, overwriting it in place. Reusing the same
+  // map across calls avoids reallocating its entries and values.
+  void ParseInto(int argc, const char *argv[], ArgumentMap &map);
+  void ParseInto(std::span<const char *> args, ArgumentMap &map);
+  void ParseInto(std::span<const std::string> args, ArgumentMap &map);
+  void ParseInto(std::string_view line, ArgumentMap &map);
+
+  // Only split the arguments into tokens. Each argument is parsed when it is
+  // first read from the map, so the cost grows with the arguments read
+  // rather than with the arguments defined. Errors surface on access, or all
+  // at once from ArgumentMap::Validate.
+  [[nodiscard]] const ArgumentMap ParseLazy(int argc, const char *argv[]);
+  [[nodiscard]] const ArgumentMap ParseLazy(std::span<const char *> args);
+  [[nodiscard]] const ArgumentMap ParseLazy(std::span<const std::string> args);
+  [[nodiscard]] const ArgumentMap ParseLazy(std::string_view line);
+
+  // Parse into a new snapshot, e.g. to hand to SnapshotPublisher::Publish.
+  [[nodiscard]] ArgumentSnapshot ParseSnapshot(int argc, const char *argv[]);
+  [[nodiscard]] ArgumentSnapshot ParseSnapshot(std::span<const char *> args);
+  [[nodiscard]] ArgumentSnapshot
+  ParseSnapshot(std::span<const std::string> args);
+  [[nodiscard]] ArgumentSnapshot ParseSnapshot(std::string_view line);
+
+  // Keep the results of ParseSnapshot for up to capacity distinct command
+  // lines, evicting the least recently used. A repeated command line returns
+  // the cached snapshot without parsing again, so binders are not called.
+  // Changing the definitions clears the cache. A capacity of 0 disables it.
+  void EnableParseCache(std::size_t capacity);
+  [[nodiscard]] ParseCacheStats GetParseCacheStats() const;
+
+  // Parse only into the destinations registered with Bind.
+  void ParseAndBind(int argc, const char *argv[]);
+  void ParseAndBind(std::span<const char *> args);
+  void ParseAndBind(std::span<const std::string> args);
+  void ParseAndBind(std::string_view line);
+
+  // Serialize the definitions to the binary format read by Schema. Binders
+  // and constraints are not serialized.
+  [[nodiscard]] std::vector<std::byte> Serialize() const;
+
+  // Print the help to standard output, wrapped to the terminal width.
   void PrintHelp() const;
+  // Write the help in a single write, wrapped to width columns, or to the
+  // terminal width if 0. The text is rendered once and cached until the
+  // definitions or the width change.
+  void PrintHelp(std::ostream &out, std::size_t width = 0) const;
+  // Copy the help into the buffer if it fits, and return its size either way.
+  [[nodiscard]] std::size_t FormatHelp(std::span<char> buffer,
+                                       std::size_t width = 0) const;
 
 private:
-  std::string m_program_description;
-  bool m_ignore_first_argument = false;
-
-  std::list<Positional> m_positionals;
-  std::list<Optional> m_optionals;
-
-  std::unordered_set<std::string> m_positional_names;
-  std::unordered_map<std::string, Optional &> m_flags_map;
-
-  void ValidateRequiredOptionals(std::span<const std::string> args) const;
-
-  void ParsePositionals(std::span<const std::string> args,
-                        ArgumentMap &map) const;
-
-  [[nodiscard]] std::size_t
-  GetMinNumberOfArguments(std::list<Positional>::const_iterator begin,
-                          std::list<Positional>::const_iterator end) const;
-
-  void ParseOptionals(std::span<const std::string> args,
-                      ArgumentMap &map) const;
+  std::shared_ptr<detail::ParserCore> m_core;
 
-  [[nodiscard]] std::size_t TryMatchOptional(std::span<const std::string> args,
-                                             ArgumentMap &map) const;
+  // The core, copied first if it is shared
+  detail::ParserCore &Mutable();
 };
 
 } // namespace argparse
@@ -25,9 +25,50 @@
 #include "argparse.hpp"
 
 #include <algorithm>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
 #include <sstream>
+#include <unordered_set>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ARGPARSE_HAS_MMAP 1
+#endif
+
+#if __has_include(<sys/ioctl.h>) && __has_include(<unistd.h>)
+#include <sys/ioctl.h>
+#include <unistd.h>
+#define ARGPARSE_HAS_IOCTL 1
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The environment block is declared differently on each platform
+#if defined(__APPLE__)
+#include <crt_externs.h>
+static char **Environment() { return *_NSGetEnviron(); }
+#elif defined(_WIN32)
+static char **Environment() { return _environ; }
+#else
+extern char **environ;
+static char **Environment() { return environ; }
+#endif
 
 namespace argparse {
 
@@ -40,7 +81,22 @@ namespace env {
 
 } // namespace env
 
-static bool IsValidFlagName(const std::string &flag) {
+#if defined(ARGPARSE_INSTRUMENTATION)
+static thread_local std::size_t t_operations = 0;
+#define ARGPARSE_COUNT_OPERATION() (++t_operations)
+
+namespace instrumentation {
+
+std::size_t Operations() { return t_operations; }
+
+void ResetOperations() { t_operations = 0; }
+
+} // namespace instrumentation
+#else
+#define ARGPARSE_COUNT_OPERATION() static_cast<void>(0)
+#endif
+
+static bool IsValidFlagName(std::string_view flag) {
 #if __cpp_lib_string_contains >= 202011L
   const bool contains_spaces = flag.contains(" ");
 #else
@@ -50,18 +106,250 @@ static bool IsValidFlagName(const std::string &flag) {
   return (!flag.empty() && flag.starts_with("-") && !contains_spaces);
 }
 
-static bool IsNumber(const std::string &str) {
-  char *pEnd;
-  std::strtod(str.c_str(), &pEnd);
+// Numbers written with digits, so "-inf" and "-nan" stay flags
+static bool IsNumber(std::string_view str) {
+  std::size_t digit = str.starts_with('-') ? 1 : 0;
+  if ((digit < str.size()) && (str[digit] == '.')) {
+    ++digit;
+  }
+  if ((digit >= str.size()) || (str[digit] < '0') || (str[digit] > '9')) {
+    return false;
+  }
+
+  double value;
+  const char *end = str.data() + str.size();
+  const auto [ptr, ec] = std::from_chars(str.data(), end, value);
+
+  return ((ec == std::errc{}) && (ptr == end));
+}
+
+// Depth of binder calls on this thread. A parse started from a binder, e.g.
+// by FromString for a user type, uses the scratch buffers of its depth and
+// leaves those of the parse that called the binder alone.
+static thread_local std::size_t t_binder_depth = 0;
+
+// A scratch buffer per binder depth. Buffers are kept per thread so that
+// repeated parses do not allocate once they have grown.
+template <typename T> class ScratchBuffer {
+public:
+  [[nodiscard]] T &Get() {
+    while (m_buffers.size() <= t_binder_depth) {
+      m_buffers.push_back(std::make_unique<T>());
+    }
+    return *m_buffers[t_binder_depth];
+  }
+
+private:
+  std::vector<std::unique_ptr<T>> m_buffers;
+};
+
+static void CallBinder(const Binder &binder,
+                       std::span<const std::string_view> values, bool append) {
+  struct Depth {
+    Depth() { ++t_binder_depth; }
+    ~Depth() { --t_binder_depth; }
+  } depth;
+  binder(values, append);
+}
+
+// Views over the arguments of the current parse
+template <typename T>
+static std::span<const std::string_view> GetTokens(std::span<T> args) {
+  static thread_local ScratchBuffer<std::vector<std::string_view>> buffer;
+  auto &tokens = buffer.Get();
+  tokens.assign(args.begin(), args.end());
+  return tokens;
+}
+
+static bool IsSpace(char c) { return (c == ' ') || (c >= '\t' && c <= '\r'); }
+
+static bool IsSpecial(char c) {
+  return IsSpace(c) || (c == '\'') || (c == '"') || (c == '\\');
+}
+
+// Index of the first whitespace, quote or backslash at or after pos.
+static std::size_t FindSpecial(std::string_view str, std::size_t pos) {
+  const std::size_t size = str.size();
+
+#if defined(__SSE2__)
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i max_space_offset = _mm_set1_epi8('\r' - '\t');
+  const __m128i single_quote = _mm_set1_epi8('\'');
+  const __m128i double_quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+
+  for (; pos + 16 <= size; pos += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(str.data() + pos));
+
+    // '\t' to '\r' are contiguous: c - '\t' <= '\r' - '\t' (unsigned)
+    const __m128i offset = _mm_sub_epi8(chunk, tab);
+    const __m128i is_control_space =
+        _mm_cmpeq_epi8(_mm_min_epu8(offset, max_space_offset), offset);
+
+    __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                                   is_control_space);
+    matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, single_quote));
+    matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, double_quote));
+    matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, backslash));
+
+    const auto mask = static_cast<unsigned>(_mm_movemask_epi8(matches));
+    if (mask != 0) {
+      return pos + static_cast<std::size_t>(__builtin_ctz(mask));
+    }
+  }
+#endif
+
+  while ((pos < size) && !IsSpecial(str[pos])) {
+    ++pos;
+  }
+  return pos;
+}
+
+// Index of the first closing double quote or backslash at or after pos.
+static std::size_t FindDoubleQuoteEnd(std::string_view str, std::size_t pos) {
+  const std::size_t size = str.size();
+
+#if defined(__SSE2__)
+  const __m128i double_quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+
+  for (; pos + 16 <= size; pos += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(str.data() + pos));
+    const __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(chunk, double_quote),
+                                         _mm_cmpeq_epi8(chunk, backslash));
+
+    const auto mask = static_cast<unsigned>(_mm_movemask_epi8(matches));
+    if (mask != 0) {
+      return pos + static_cast<std::size_t>(__builtin_ctz(mask));
+    }
+  }
+#endif
+
+  while ((pos < size) && (str[pos] != '"') && (str[pos] != '\\')) {
+    ++pos;
+  }
+  return pos;
+}
+
+/* Split a command line into tokens following POSIX shell quoting: single
+ * quotes are literal, double quotes allow escaping \\, ", $ and `, and a
+ * backslash outside quotes escapes the next character. Tokens without quotes
+ * or escapes are views into the line; the rest are unescaped into a buffer
+ * that is reserved up front, so views into it stay valid.
+ */
+static std::span<const std::string_view>
+SplitCommandLine(std::string_view line) {
+  static thread_local ScratchBuffer<std::vector<std::string_view>> buffer;
+  static thread_local ScratchBuffer<std::string> unescaped_buffer;
+  auto &tokens = buffer.Get();
+  auto &unescaped = unescaped_buffer.Get();
+  tokens.clear();
+  unescaped.clear();
+  unescaped.reserve(line.size());
+
+  const std::size_t size = line.size();
+  std::size_t pos = 0;
+  while (true) {
+    while ((pos < size) && IsSpace(line[pos])) {
+      ++pos;
+    }
+    if (pos == size) {
+      break;
+    }
+
+    const std::size_t token_begin = pos;
+    pos = FindSpecial(line, pos);
+    if ((pos == size) || IsSpace(line[pos])) {
+      tokens.push_back(line.substr(token_begin, pos - token_begin));
+      continue;
+    }
+
+    const std::size_t unescaped_begin = unescaped.size();
+    unescaped.append(line.substr(token_begin, pos - token_begin));
+    while ((pos < size) && !IsSpace(line[pos])) {
+      const char c = line[pos];
+      if (c == '\'') {
+        const std::size_t end = line.find('\'', pos + 1);
+        if (end == std::string_view::npos) {
+          throw std::runtime_error("Unterminated quote in command line.");
+        }
+        unescaped.append(line.substr(pos + 1, end - pos - 1));
+        pos = end + 1;
+      } else if (c == '"') {
+        ++pos;
+        while (true) {
+          const std::size_t end = FindDoubleQuoteEnd(line, pos);
+          if (end == size) {
+            throw std::runtime_error("Unterminated quote in command line.");
+          }
+          unescaped.append(line.substr(pos, end - pos));
+          pos = end + 1;
+          if (line[end] == '"') {
+            break;
+          }
+
+          // Backslash: only some characters can be escaped in double quotes
+          if (pos < size) {
+            const char escaped = line[pos];
+            if ((escaped == '\\') || (escaped == '"') || (escaped == '$') ||
+                (escaped == '`')) {
+              unescaped.push_back(escaped);
+              ++pos;
+            } else if (escaped == '\n') {
+              ++pos;
+            } else {
+              unescaped.push_back('\\');
+            }
+          }
+        }
+      } else if (c == '\\') {
+        if (pos + 1 == size) {
+          unescaped.push_back('\\');
+          ++pos;
+        } else {
+          if (line[pos + 1] != '\n') {
+            unescaped.push_back(line[pos + 1]);
+          }
+          pos += 2;
+        }
+      } else {
+        const std::size_t end = FindSpecial(line, pos);
+        unescaped.append(line.substr(pos, end - pos));
+        pos = end;
+      }
+    }
+    tokens.push_back(std::string_view{unescaped}.substr(unescaped_begin));
+  }
 
-  return (pEnd == nullptr);
+  return tokens;
 }
 
-static bool IsOption(const std::string &str) {
-  return (str.starts_with("-") && !IsNumber(str));
+static std::size_t EditDistance(std::string_view a, std::string_view b) {
+  static thread_local std::vector<std::size_t> row;
+  row.resize(b.size() + 1);
+  for (std::size_t j = 0; j <= b.size(); ++j) {
+    row[j] = j;
+  }
+
+  for (std::size_t i = 1; i <= a.size(); ++i) {
+    std::size_t diagonal = row[0];
+    row[0] = i;
+    for (std::size_t j = 1; j <= b.size(); ++j) {
+      const std::size_t above = row[j];
+      const std::size_t substitution =
+          diagonal + ((a[i - 1] == b[j - 1]) ? 0 : 1);
+      row[j] = std::min({above + 1, row[j - 1] + 1, substitution});
+      diagonal = above;
+    }
+  }
+
+  return row[b.size()];
 }
 
-static NArgs GetNArgsFromString(const std::string &str) {
+static NArgs GetNArgsFromString(std::string_view str) {
   if (str == "?") {
     return NArgs::OPTIONAL;
   } else if (str == "*") {
@@ -70,7 +358,20 @@ static NArgs GetNArgsFromString(const std::string &str) {
     return NArgs::ONE_OR_MORE;
   }
 
-  throw std::runtime_error(str + " is not a valid number of arguments");
+  throw std::runtime_error(std::string{str} +
+                           " is not a valid number of arguments");
+}
+
+// A number of arguments or one of "?", "*" and "+"
+static std::pair<NArgs, std::size_t> ParseNArgs(std::string_view str) {
+  std::size_t num_args = 0;
+  const char *end = str.data() + str.size();
+  const auto [ptr, ec] = std::from_chars(str.data(), end, num_args);
+  if (!str.empty() && (ec == std::errc{}) && (ptr == end)) {
+    return {NArgs::NUMERIC, num_args};
+  }
+
+  return {GetNArgsFromString(str), 1};
 }
 
 static std::string PrettyNArgs(std::pair<NArgs, std::size_t> nargs) {
@@ -79,7 +380,10 @@ static std::string PrettyNArgs(std::pair<NArgs, std::size_t> nargs) {
   switch (nargs_flag) {
   case NArgs::NUMERIC: {
     if (num_args > 1) {
-      return "[" + std::to_string(num_args) + "]";
+      std::string pretty = "[";
+      pretty += std::to_string(num_args);
+      pretty += "]";
+      return pretty;
     } else {
       return "";
     }
@@ -99,22 +403,683 @@ static std::string PrettyNArgs(std::pair<NArgs, std::size_t> nargs) {
   }
 }
 
-static constexpr auto StrToInt = [](const std::string &str) -> int {
-  return std::stoi(str, nullptr);
+template <typename T> static T NumberFromString(std::string_view str) {
+  const auto first_non_space = str.find_first_not_of(" \t\n\v\f\r");
+  str.remove_prefix(std::min(first_non_space, str.size()));
+  if (str.starts_with('+') && !str.starts_with("+-")) {
+    str.remove_prefix(1);
+  }
+
+  T value{};
+  const auto [ptr, ec] =
+      std::from_chars(str.data(), str.data() + str.size(), value);
+  if (ec == std::errc::invalid_argument) {
+    throw std::invalid_argument("Cannot convert '" + std::string{str} +
+                                "' to a number.");
+  } else if (ec == std::errc::result_out_of_range) {
+    throw std::out_of_range("'" + std::string{str} + "' is out of range.");
+  }
+
+  return value;
+}
+
+template <> std::string FromString<std::string>(std::string_view str) {
+  return std::string{str};
+}
+
+template <> bool FromString<bool>(std::string_view str) {
+  if (str == "true" || str == "1" || str == "yes" || str == "on") {
+    return true;
+  } else if (str == "false" || str == "0" || str == "no" || str == "off") {
+    return false;
+  }
+
+  throw std::invalid_argument("Cannot convert '" + std::string{str} +
+                              "' to a boolean.");
+}
+
+template <> int FromString<int>(std::string_view str) {
+  return NumberFromString<int>(str);
+}
+
+template <> long FromString<long>(std::string_view str) {
+  return NumberFromString<long>(str);
+}
+
+template <> float FromString<float>(std::string_view str) {
+  return NumberFromString<float>(str);
+}
+
+template <> double FromString<double>(std::string_view str) {
+  return NumberFromString<double>(str);
+}
+
+namespace {
+
+struct Unit {
+  std::string_view suffix;
+  std::uint64_t factor;
+};
+
+constexpr std::uint64_t KB = 1000;
+constexpr std::uint64_t KIB = 1024;
+
+constexpr std::array<Unit, 15> BYTE_UNITS = {{
+    {"", 1},
+    {"B", 1},
+    {"kB", KB},
+    {"KB", KB},
+    {"KiB", KIB},
+    {"MB", KB * KB},
+    {"MiB", KIB * KIB},
+    {"GB", KB * KB * KB},
+    {"GiB", KIB * KIB * KIB},
+    {"TB", KB * KB * KB * KB},
+    {"TiB", KIB * KIB * KIB * KIB},
+    {"PB", KB * KB * KB * KB * KB},
+    {"PiB", KIB * KIB * KIB * KIB * KIB},
+    {"EB", KB * KB * KB * KB * KB * KB},
+    {"EiB", KIB * KIB * KIB * KIB * KIB * KIB},
+}};
+
+constexpr std::array<Unit, 4> COUNT_UNITS = {{
+    {"", 1},
+    {"k", KB},
+    {"M", KB * KB},
+    {"G", KB * KB * KB},
+}};
+
+// In nanoseconds
+constexpr std::array<Unit, 7> DURATION_UNITS = {{
+    {"ns", 1},
+    {"us", 1000},
+    {"ms", 1000 * 1000},
+    {"s", 1000 * 1000 * 1000},
+    {"min", 60ULL * 1000 * 1000 * 1000},
+    {"h", 60ULL * 60 * 1000 * 1000 * 1000},
+    {"d", 24ULL * 60 * 60 * 1000 * 1000 * 1000},
+}};
+
+} // namespace
+
+static std::uint64_t UnitFactor(std::string_view str, std::string_view suffix,
+                                std::span<const Unit> units) {
+  const auto unit = std::ranges::find(units, suffix, &Unit::suffix);
+  if (unit == units.end()) {
+    throw std::invalid_argument("Unknown unit in '" + std::string{str} + "'.");
+  }
+  return unit->factor;
+}
+
+// Parse an unsigned number followed by one of the units, e.g. "512MiB", and
+// scale it by the unit. Nothing else may follow the unit.
+static std::uint64_t QuantityFromString(std::string_view str,
+                                        std::span<const Unit> units) {
+  std::uint64_t value = 0;
+  const char *end = str.data() + str.size();
+  const auto [ptr, ec] = std::from_chars(str.data(), end, value);
+  if (ec == std::errc::invalid_argument) {
+    throw std::invalid_argument("Cannot convert '" + std::string{str} +
+                                "' to a quantity.");
+  } else if (ec == std::errc::result_out_of_range) {
+    throw std::out_of_range("'" + std::string{str} + "' is out of range.");
+  }
+
+  const std::string_view suffix(ptr, static_cast<std::size_t>(end - ptr));
+  const std::uint64_t factor = UnitFactor(str, suffix, units);
+  if (value > (std::numeric_limits<std::uint64_t>::max() / factor)) {
+    throw std::out_of_range("'" + std::string{str} + "' is out of range.");
+  }
+
+  return value * factor;
+}
+
+static std::uint64_t NanosecondsFromString(std::string_view str) {
+  const std::uint64_t nanoseconds = QuantityFromString(str, DURATION_UNITS);
+  if (nanoseconds > static_cast<std::uint64_t>(
+                        std::numeric_limits<std::int64_t>::max())) {
+    throw std::out_of_range("'" + std::string{str} + "' is out of range.");
+  }
+  return nanoseconds;
+}
+
+template <typename Duration>
+static Duration DurationFromString(std::string_view str) {
+  using Period = std::ratio_divide<typename Duration::period, std::nano>;
+  static_assert(Period::den == 1, "Durations finer than 1ns are unsupported");
+
+  const std::uint64_t nanoseconds = NanosecondsFromString(str);
+  if ((nanoseconds % Period::num) != 0) {
+    throw std::invalid_argument("'" + std::string{str} +
+                                "' is not a whole number of the unit read.");
+  }
+  return Duration{
+      static_cast<typename Duration::rep>(nanoseconds / Period::num)};
+}
+
+// Split a rate like "10MiB/s" or "5/2min" into its amount and the seconds it
+// is spread over.
+static std::pair<std::string_view, double> SplitRate(std::string_view str) {
+  const std::size_t slash = str.find('/');
+  if (slash == std::string_view::npos) {
+    throw std::invalid_argument("Cannot convert '" + std::string{str} +
+                                "' to a rate.");
+  }
+
+  // A bare unit stands for one of it
+  const std::string_view interval = str.substr(slash + 1);
+  const bool bare_unit =
+      !interval.empty() && ((interval[0] < '0') || (interval[0] > '9'));
+  const double nanoseconds =
+      bare_unit ? static_cast<double>(UnitFactor(str, interval, DURATION_UNITS))
+                : static_cast<double>(NanosecondsFromString(interval));
+  if (nanoseconds == 0) {
+    throw std::invalid_argument("'" + std::string{str} +
+                                "' has an empty interval.");
+  }
+
+  return {str.substr(0, slash), nanoseconds / 1e9};
+}
+
+template <> ByteSize FromString<ByteSize>(std::string_view str) {
+  return ByteSize{QuantityFromString(str, BYTE_UNITS)};
+}
+
+template <> Rate FromString<Rate>(std::string_view str) {
+  const auto [amount, seconds] = SplitRate(str);
+  const double count =
+      static_cast<double>(QuantityFromString(amount, COUNT_UNITS));
+  return Rate{count / seconds};
+}
+
+template <> ByteRate FromString<ByteRate>(std::string_view str) {
+  const auto [amount, seconds] = SplitRate(str);
+  const double bytes =
+      static_cast<double>(QuantityFromString(amount, BYTE_UNITS));
+  return ByteRate{bytes / seconds};
+}
+
+template <>
+std::chrono::nanoseconds FromString<std::chrono::nanoseconds>(
+    std::string_view str) {
+  return DurationFromString<std::chrono::nanoseconds>(str);
+}
+
+template <>
+std::chrono::microseconds FromString<std::chrono::microseconds>(
+    std::string_view str) {
+  return DurationFromString<std::chrono::microseconds>(str);
+}
+
+template <>
+std::chrono::milliseconds FromString<std::chrono::milliseconds>(
+    std::string_view str) {
+  return DurationFromString<std::chrono::milliseconds>(str);
+}
+
+template <>
+std::chrono::seconds FromString<std::chrono::seconds>(std::string_view str) {
+  return DurationFromString<std::chrono::seconds>(str);
+}
+
+template <>
+std::chrono::minutes FromString<std::chrono::minutes>(std::string_view str) {
+  return DurationFromString<std::chrono::minutes>(str);
+}
+
+template <>
+std::chrono::hours FromString<std::chrono::hours>(std::string_view str) {
+  return DurationFromString<std::chrono::hours>(str);
+}
+
+std::string ToString(ByteSize value) { return std::to_string(value.bytes); }
+
+// A rate as a whole amount over the shortest interval that gives one, e.g.
+// "5/s" or "1/min". Otherwise it is rounded over the longest interval, up to
+// 100 days, that keeps the amount in range.
+static std::string RateToString(double per_second) {
+  static constexpr std::array<std::pair<double, std::string_view>, 5>
+      INTERVALS{{{1, "s"}, {60, "min"}, {3600, "h"}, {86400, "d"},
+                 {8640000, "100d"}}};
+
+  // 2^64, the first amount out of range
+  const double max_amount =
+      static_cast<double>(std::numeric_limits<std::uint64_t>::max());
+  if (!(per_second >= 0) || (per_second >= max_amount)) {
+    throw std::out_of_range("Rate " + std::to_string(per_second) +
+                            " cannot be written.");
+  }
+
+  const auto format = [](double amount, std::string_view unit) {
+    return std::to_string(static_cast<std::uint64_t>(std::round(amount))) +
+           "/" + std::string{unit};
+  };
+
+  std::size_t longest = 0;
+  for (std::size_t i = 0; i < INTERVALS.size(); ++i) {
+    const double amount = per_second * INTERVALS[i].first;
+    if (std::round(amount) >= max_amount) {
+      break;
+    } else if (amount == std::floor(amount)) {
+      return format(amount, INTERVALS[i].second);
+    }
+    longest = i;
+  }
+
+  return format(per_second * INTERVALS[longest].first,
+                INTERVALS[longest].second);
+}
+
+std::string ToString(Rate value) { return RateToString(value.per_second); }
+
+std::string ToString(ByteRate value) {
+  return RateToString(value.bytes_per_second);
+}
+
+std::string ToString(std::chrono::nanoseconds value) {
+  return std::to_string(value.count()) + "ns";
+}
+
+std::string ToString(std::chrono::microseconds value) {
+  return std::to_string(value.count()) + "us";
+}
+
+std::string ToString(std::chrono::milliseconds value) {
+  return std::to_string(value.count()) + "ms";
+}
+
+std::string ToString(std::chrono::seconds value) {
+  return std::to_string(value.count()) + "s";
+}
+
+std::string ToString(std::chrono::minutes value) {
+  return std::to_string(value.count()) + "min";
+}
+
+std::string ToString(std::chrono::hours value) {
+  return std::to_string(value.count()) + "h";
+}
+
+namespace detail {
+
+// A flag of an optional defined with AddOptionals
+struct TableFlag {
+  std::string_view flag;
+  std::size_t optional; // Index in the table optionals of the parser
+};
+
+// An optional defined with AddOptional, with AddOptionals or in a Schema
+struct OptionalRef {
+  std::size_t id = 0;
+  NArgs nargs = NArgs::NUMERIC;
+  std::size_t num_args = 1;
+  bool required = false;
+  argparse::Action action = argparse::Action::STORE;
+  std::string_view help = {};
+  const Binder *binder = nullptr;
+  std::size_t num_flags = 0;
+
+  const Optional *optional = nullptr;
+  const TableFlag *table_flags = nullptr;
+  const Schema *schema = nullptr;
+  std::size_t first_flag = 0;
+
+  [[nodiscard]] std::string_view Flag(std::size_t index) const;
+};
+
+// A positional defined either with AddPositional or in a Schema
+struct PositionalRef {
+  const Positional *positional = nullptr;
+  Schema::PositionalEntry entry;
+
+  [[nodiscard]] std::string_view Name() const;
+  [[nodiscard]] std::string_view Help() const;
+  [[nodiscard]] std::pair<NArgs, std::size_t> GetNArgs() const;
+  [[nodiscard]] const Binder *GetBinder() const;
+};
+
+// Default values by argument name. The defaults of a parser extending
+// another one are kept over those of its base.
+struct Defaults {
+  std::shared_ptr<const Defaults> base;
+  std::unordered_map<std::string, Argument, StringHash, std::equal_to<>>
+      arguments;
+
+  [[nodiscard]] const Argument *Find(std::string_view name) const;
 };
 
-static constexpr auto StrToLong = [](const std::string &str) -> long {
-  return std::stol(str, nullptr);
+struct LazyDefinitions;
+
+// Definitions of an ArgumentParser and the parsing done with them. Shared by
+// the copies of a parser. A parser that changes shared definitions extends
+// them with a layer of its own rather than copying them, see Extend.
+// Binder calls of a parse, made only once the whole parse has succeeded so
+// that a failed parse leaves the destinations alone
+class Bindings {
+public:
+  void Clear() {
+    m_calls.clear();
+    m_values.clear();
+  }
+  void Add(const Binder &binder, std::span<const std::string_view> values,
+           bool append) {
+    m_calls.push_back({&binder, m_values.size(), values.size(), append});
+    m_values.insert(m_values.end(), values.begin(), values.end());
+  }
+  // Counted optionals bind the count of the occurrences so far
+  void AddCount(const Binder &binder, std::size_t count) {
+    m_calls.push_back({&binder, 0, count, false, true});
+  }
+  void Apply() const {
+    for (const auto &call : m_calls) {
+      if (call.count) {
+        char buffer[24];
+        const auto result =
+            std::to_chars(buffer, buffer + sizeof(buffer), call.num_values);
+        const std::string_view count{buffer, result.ptr};
+        CallBinder(*call.binder, {&count, 1}, false);
+      } else {
+        CallBinder(*call.binder,
+                   std::span{m_values}.subspan(call.first, call.num_values),
+                   call.append);
+      }
+    }
+  }
+
+private:
+  struct Call {
+    const Binder *binder = nullptr;
+    std::size_t first = 0;
+    std::size_t num_values = 0; // Or the count
+    bool append = false;
+    bool count = false;
+  };
+  std::vector<Call> m_calls;
+  std::vector<std::string_view> m_values;
 };
 
-static constexpr auto StrToFloat = [](const std::string &str) -> float {
-  return std::stof(str, nullptr);
+class ParserCore final : public std::enable_shared_from_this<ParserCore> {
+public:
+  ParserCore() = default;
+  explicit ParserCore(const std::string &description);
+  explicit ParserCore(const Schema &schema);
+  // A copy of the definitions of this layer, over the same base
+  ParserCore(const ParserCore &other);
+  ParserCore &operator=(const ParserCore &) = delete;
+
+  // A parser adding definitions over those of core, which must not change
+  // anymore. Extending a layer copies that layer over the same base instead,
+  // so lookups never go through more than one base.
+  [[nodiscard]] static std::shared_ptr<ParserCore>
+  Extend(std::shared_ptr<const ParserCore> core);
+
+  // Called by the definitions of this parser before they change
+  void Touch();
+  // Whether other parsers share this core, so it must not change
+  [[nodiscard]] bool IsShared() const;
+  void SetDefault(std::span<const std::string> names,
+                  const std::shared_ptr<const DefaultValue> &value);
+  // Called by an optional of this parser once it is made required or not
+  void UpdateRequired(const Optional &optional);
+
+  void IgnoreFirstArgument(bool ignore = true);
+  Positional &AddPositional(const std::string &name);
+  Optional &AddOptional(std::initializer_list<std::string> flags);
+  Optional &AddOptional(const std::string &flag);
+  void AddOptionals(std::span<const OptionalSpec> table);
+  void AddMutuallyExclusive(std::initializer_list<std::string> flags,
+                            bool required = false);
+  void AddDependency(const std::string &flag,
+                     std::initializer_list<std::string> dependencies);
+  [[nodiscard]] const ArgumentMap Parse(int argc, const char *argv[]);
+  [[nodiscard]] const ArgumentMap Parse(std::span<const char *> args);
+  [[nodiscard]] const ArgumentMap Parse(std::span<const std::string> args);
+  [[nodiscard]] const ArgumentMap Parse(std::string_view line);
+  void ParseInto(int argc, const char *argv[], ArgumentMap &map);
+  void ParseInto(std::span<const char *> args, ArgumentMap &map);
+  void ParseInto(std::span<const std::string> args, ArgumentMap &map);
+  void ParseInto(std::string_view line, ArgumentMap &map);
+  [[nodiscard]] const ArgumentMap ParseLazy(int argc, const char *argv[]);
+  [[nodiscard]] const ArgumentMap ParseLazy(std::span<const char *> args);
+  [[nodiscard]] const ArgumentMap ParseLazy(std::span<const std::string> args);
+  [[nodiscard]] const ArgumentMap ParseLazy(std::string_view line);
+  [[nodiscard]] ArgumentSnapshot ParseSnapshot(int argc, const char *argv[]);
+  [[nodiscard]] ArgumentSnapshot ParseSnapshot(std::span<const char *> args);
+  [[nodiscard]] ArgumentSnapshot
+  ParseSnapshot(std::span<const std::string> args);
+  [[nodiscard]] ArgumentSnapshot ParseSnapshot(std::string_view line);
+  void EnableParseCache(std::size_t capacity);
+  [[nodiscard]] ParseCacheStats GetParseCacheStats() const;
+  void ParseAndBind(int argc, const char *argv[]);
+  void ParseAndBind(std::span<const char *> args);
+  void ParseAndBind(std::span<const std::string> args);
+  void ParseAndBind(std::string_view line);
+  [[nodiscard]] std::vector<std::byte> Serialize() const;
+  void PrintHelp() const;
+  void PrintHelp(std::ostream &out, std::size_t width = 0) const;
+  [[nodiscard]] std::size_t FormatHelp(std::span<char> buffer,
+                                       std::size_t width = 0) const;
+
+private:
+  std::string m_program_description;
+  bool m_ignore_first_argument = false;
+
+  // Definitions extended by this parser, shared and never changed. The
+  // definitions of this layer come after them and have higher ids.
+  std::shared_ptr<const ParserCore> m_base;
+
+  // Definitions of this layer
+  std::list<Positional> m_positionals;
+  std::list<Optional> m_optionals;
+  // Required optionals of m_optionals, by id, so validation does not visit
+  // the others
+  std::vector<const Optional *> m_required_optionals;
+
+  struct AttachedSchema {
+    Schema schema;
+    std::size_t first_id; // Id of the first optional in the schema
+  };
+  std::vector<AttachedSchema> m_schemas;
+
+  // Optionals of every AddOptionals table. Strings are kept in chunks shared
+  // by copies of the parser, and flags in one open addressing index.
+  struct TableOptional {
+    std::size_t id = 0;
+    std::string_view help;
+    NArgs nargs = NArgs::NUMERIC;
+    std::size_t num_args = 1;
+    bool required = false;
+    argparse::Action action = argparse::Action::STORE;
+    std::size_t first_flag = 0; // In m_table_flags
+    std::size_t num_flags = 0;
+  };
+  std::vector<std::shared_ptr<const std::string>> m_table_strings;
+  std::vector<TableOptional> m_table_optionals;
+  std::vector<detail::TableFlag> m_table_flags;
+  std::vector<std::size_t> m_table_index;    // Flag index + 1, or 0 if free
+  std::vector<std::size_t> m_table_required; // Indexes of required optionals
+
+  // Bumped whenever the definitions change
+  std::uint64_t m_generation = 0;
+
+  struct CacheEntry {
+    std::string key;
+    ArgumentSnapshot snapshot;
+  };
+  std::size_t m_cache_capacity = 0;
+  std::uint64_t m_cache_generation = 0;
+  std::list<CacheEntry> m_cache; // Most recently used first
+  std::unordered_map<std::string_view, std::list<CacheEntry>::iterator>
+      m_cache_index; // Keys point into m_cache
+  ParseCacheStats m_cache_stats;
+  mutable std::mutex m_cache_mutex;
+
+  // Optionals by environment variable, rebuilt when the definitions change.
+  // The generation is stored after the index, so parses lock only to rebuild.
+  using EnvIndex = std::unordered_map<std::string_view, const Optional *>;
+  mutable EnvIndex m_env_index;
+  mutable std::atomic<std::uint64_t> m_env_index_generation =
+      ~std::uint64_t{0};
+  mutable std::mutex m_env_index_mutex;
+
+  // Shared with the maps of every parse, which may outlive the parser, and
+  // copied by SetDefault while shared
+  std::shared_ptr<detail::Defaults> m_defaults =
+      std::make_shared<detail::Defaults>();
+
+  // All positionals in definition order, including those of the base
+  std::vector<detail::PositionalRef> m_positional_order;
+  std::size_t m_num_optionals = 0; // Including those of the base
+
+  // Names and flags of this layer
+  std::unordered_set<std::string, detail::StringHash, std::equal_to<>>
+      m_positional_names;
+  std::unordered_map<std::string, Optional &, detail::StringHash,
+                     std::equal_to<>>
+      m_flags_map;
+
+  // Rules between optionals, compiled to bitmasks over their ids. A mask
+  // covers only the words of the ids bitset between its lowest and highest id.
+  struct Constraint {
+    enum class Kind { EXCLUSIVE, REQUIRED_EXCLUSIVE, DEPENDENCY };
+
+    Kind kind;
+    std::size_t trigger = 0;    // Id that enables a dependency
+    std::size_t first_word = 0; // First word of the ids bitset covered
+    std::size_t mask = 0;       // Offset of the mask in m_constraint_masks
+    std::size_t num_words = 0;
+    std::vector<std::string> flags; // As declared, for error messages
+  };
+  std::vector<Constraint> m_constraints;
+  std::vector<std::uint64_t> m_constraint_masks;
+
+  // Built on the first undefined option after the flags change.
+  mutable std::unique_ptr<const detail::BKTree> m_flags_index;
+  mutable std::mutex m_flags_index_mutex;
+
+  // Help rendered for a width, until the definitions change
+  mutable std::shared_ptr<const std::string> m_help;
+  mutable std::size_t m_help_width = 0;
+  mutable std::uint64_t m_help_generation = 0;
+  mutable std::mutex m_help_mutex;
+
+  // Held by the lazy maps parsed since the last change, which resolve
+  // their arguments with this parser. The next change hands them a copy of
+  // the definitions first, so the parser keeps changing its own in place
+  // and references returned by AddOptional and AddPositional stay valid.
+  mutable std::weak_ptr<LazyDefinitions> m_lazy_definitions;
+  mutable std::mutex m_lazy_mutex;
+
+  template <typename Input> ArgumentSnapshot ParseCached(Input input);
+  [[nodiscard]] ArgumentSnapshot FindCached(std::string_view key);
+  void StoreCached(std::string_view key, const ArgumentSnapshot &snapshot);
+
+  void AttachSchema(const Schema &schema);
+  void AddConstraint(Constraint::Kind kind, std::vector<std::string> flags);
+  void CheckConstraint(const Constraint &constraint,
+                       std::span<const std::uint64_t> present) const;
+  // Visit the base, if any, and then this layer
+  template <typename Visit> void ForEachLayer(Visit &&visit) const {
+    if (m_base != nullptr) {
+      visit(*m_base);
+    }
+    visit(*this);
+  }
+  [[nodiscard]] bool HasPositional(std::string_view name) const;
+  [[nodiscard]] bool HasFlag(std::string_view flag) const;
+  // Index the table flags from first on, or all of them if the index grows.
+  // Returns a flag that is defined twice, if any.
+  [[nodiscard]] std::optional<std::string_view>
+  IndexTableFlags(std::size_t first);
+  [[nodiscard]] std::optional<std::size_t>
+  FindTableFlag(std::string_view flag) const;
+  [[nodiscard]] detail::OptionalRef TableRef(std::size_t index) const;
+  detail::Defaults &MutableDefaults();
+  [[nodiscard]] bool IsOption(std::string_view token) const;
+
+  [[nodiscard]] std::optional<detail::OptionalRef>
+  FindOptional(std::string_view flag) const;
+  // Visit all optionals in id order
+  void ForEachOptional(
+      const std::function<void(const detail::OptionalRef &)> &visit) const;
+
+  [[nodiscard]] std::shared_ptr<const std::string>
+  GetHelp(std::size_t width) const;
+  [[nodiscard]] std::string RenderHelp(std::size_t width) const;
+
+  struct EnvValue {
+    const Optional *optional;
+    std::string_view variable;
+    std::string_view value;
+  };
+  [[nodiscard]] const EnvIndex &GetEnvIndex() const;
+  // The value of an entry "NAME=value" for the optional reading NAME
+  [[nodiscard]] static std::optional<EnvValue>
+  MatchEnvEntry(const EnvIndex &index, std::string_view entry);
+  // Values of the optionals set in the environment, from one scan of it
+  [[nodiscard]] std::span<const EnvValue> ScanEnvironment() const;
+  // The same from entries kept from an earlier scan
+  [[nodiscard]] std::span<const EnvValue>
+  ScanEnvironment(std::span<const std::string_view> entries) const;
+
+  void ParseArgs(std::span<const std::string_view> args,
+                 ArgumentMap *map) const;
+  // Binders are called at the end when bind is true
+  void ParseArgs(std::span<const std::string_view> args,
+                 std::span<const EnvValue> env_values, ArgumentMap *map,
+                 bool bind = true) const;
+
+  friend class argparse::ArgumentMap;
+  [[nodiscard]] ArgumentMap
+  MakeLazy(std::span<const std::string_view> tokens) const;
+  [[nodiscard]] const Argument *ResolveLazy(ArgumentMap::LazyState &state,
+                                            std::string_view name,
+                                            bool with_defaults) const;
+  void ResolveLazyOptional(ArgumentMap::LazyState &state,
+                           const detail::OptionalRef &optional) const;
+  void ValidateLazy(ArgumentMap::LazyState &state) const;
+
+  void ValidateRequiredOptionals(std::span<const std::string_view> args,
+                                 std::span<const EnvValue> env_values) const;
+
+  // The values are stored in map and their binder calls added to bindings,
+  // each when not null
+  void ParsePositionals(std::span<const std::string_view> args,
+                        ArgumentMap *map, Bindings *bindings) const;
+
+  void ParseOptionals(std::span<const std::string_view> args,
+                      std::span<const EnvValue> env_values, ArgumentMap *map,
+                      Bindings *bindings) const;
+
+  [[nodiscard]] std::size_t
+  TryMatchOptional(std::span<const std::string_view> args, ArgumentMap *map,
+                   Bindings *bindings,
+                   std::span<std::size_t> occurrences) const;
+  void ApplyEnvValue(const EnvValue &env_value, ArgumentMap *map,
+                     Bindings *bindings, std::size_t &occurrence) const;
+  // Check the number of values of one occurrence and store them. source is
+  // the flag or variable the values came from, and occurrence counts the
+  // earlier occurrences of the optional in the parse.
+  void StoreOptional(const detail::OptionalRef &optional,
+                     std::string_view source,
+                     std::span<const std::string_view> values,
+                     ArgumentMap *map, Bindings *bindings,
+                     std::size_t &occurrence) const;
+
+  [[nodiscard]] std::string
+  UndefinedOptionMessage(std::string_view token) const;
 };
 
-static constexpr auto StrToDouble = [](const std::string &str) -> double {
-  return std::stod(str, nullptr);
+// The parser lazy maps resolve their arguments with: the one they were
+// parsed with until it changes, and then a copy of it as it was. Resolving
+// holds the lock shared, and replacing the parser holds it exclusively.
+struct LazyDefinitions {
+  std::shared_mutex mutex;
+  std::shared_ptr<const ParserCore> parser;
 };
 
+} // namespace detail
+
 Positional::Positional(const std::string &_name) : name(_name) {
   if (name.empty()) {
     throw std::runtime_error("Arguments cannot have an empty name.");
@@ -123,11 +1088,25 @@ Positional::Positional(const std::string &_name) : name(_name) {
   }
 }
 
+void detail::Touch(ParserCore *owner) {
+  if (owner != nullptr) {
+    owner->Touch();
+  }
+}
+
+void detail::SetDefault(ParserCore *owner, std::span<const std::string> names,
+                        const std::shared_ptr<const DefaultValue> &value) {
+  if (owner != nullptr) {
+    owner->SetDefault(names, value);
+  }
+}
+
 Positional &Positional::NumArgs(std::size_t num) {
   if (num == 0) {
     throw std::runtime_error("NumArgs cannot be 0 for Positional arguments.");
   }
 
+  detail::Touch(owner);
   nargs = NArgs::NUMERIC;
   num_args = num;
 
@@ -135,6 +1114,7 @@ Positional &Positional::NumArgs(std::size_t num) {
 }
 
 Positional &Positional::NumArgs(NArgs num) {
+  detail::Touch(owner);
   nargs = num;
   return *this;
 }
@@ -145,6 +1125,7 @@ Positional &Positional::NumArgs(const std::string &num) {
 }
 
 Positional &Positional::Help(const std::string &help_str) {
+  detail::Touch(owner);
   help = help_str;
   return *this;
 }
@@ -168,6 +1149,11 @@ Optional::Optional(const std::string &flag)
     : Optional(std::initializer_list<std::string>{flag}) {}
 
 Optional &Optional::NumArgs(std::size_t num) {
+  if ((action == argparse::Action::COUNT) && (num != 0)) {
+    throw std::runtime_error("A counted optional cannot take arguments.");
+  }
+
+  detail::Touch(owner);
   nargs = NArgs::NUMERIC;
   num_args = num;
 
@@ -178,8 +1164,14 @@ Optional &Optional::NumArgs(NArgs num) {
   if (required &&
       ((nargs == NArgs::OPTIONAL) || (nargs == NArgs::ZERO_OR_MORE))) {
     throw std::runtime_error("An required optional cannot be made required.");
+  } else if ((num != NArgs::NUMERIC) &&
+             ((action == argparse::Action::APPEND) ||
+              (action == argparse::Action::COUNT))) {
+    throw std::runtime_error(
+        "Appended and counted optionals need a numeric number of arguments.");
   }
 
+  detail::Touch(owner);
   nargs = num;
   return *this;
 }
@@ -195,15 +1187,47 @@ Optional &Optional::Required(bool req) {
     throw std::runtime_error("An optional argument cannot be made required.");
   }
 
+  detail::Touch(owner);
   required = req;
+  if (owner != nullptr) {
+    owner->UpdateRequired(*this);
+  }
   return *this;
 }
 
 Optional &Optional::Help(const std::string &help_str) {
+  detail::Touch(owner);
   help = help_str;
   return *this;
 }
 
+Optional &Optional::Action(argparse::Action act) {
+  if ((act == argparse::Action::APPEND) && (nargs != NArgs::NUMERIC)) {
+    throw std::runtime_error(
+        "Appended optionals need a numeric number of arguments.");
+  }
+
+  detail::Touch(owner);
+  action = act;
+  if (action == argparse::Action::COUNT) {
+    nargs = NArgs::NUMERIC;
+    num_args = 0;
+  }
+
+  return *this;
+}
+
+Optional &Optional::Env(const std::string &variable) {
+  if (variable.empty() || (variable.find('=') != std::string::npos)) {
+    throw std::runtime_error("Invalid environment variable name " + variable +
+                             ".");
+  }
+
+  detail::Touch(owner);
+  env = variable;
+  return *this;
+}
+
 std::pair<NArgs, std::size_t> Optional::GetNArgs() const {
   return {nargs, num_args};
 }
@@ -214,241 +1238,2351 @@ bool Optional::HasFlag(const std::string &flag) const {
   return has_flag;
 }
 
-Argument::Argument(std::span<const char *> values) {
-  std::copy(values.begin(), values.end(), std::back_inserter(m_values));
-}
-
-Argument::Argument(std::span<const std::string> values) {
-  std::copy(values.begin(), values.end(), std::back_inserter(m_values));
-}
+Argument::Argument(std::span<const char *> values)
+    : m_values(values.begin(), values.end()) {}
 
-std::size_t Argument::Size() const { return m_values.size(); }
+Argument::Argument(std::span<const std::string> values)
+    : m_values(values.begin(), values.end()) {}
 
-template <> std::string Argument::As<std::string>(std::size_t index) const {
-  return m_values[index];
-}
+Argument::Argument(std::span<const std::string_view> values)
+    : m_values(values.begin(), values.end()) {}
 
-template <> std::vector<std::string> Argument::AsVector<std::string>() const {
-  return m_values;
-}
+Argument::Argument(std::shared_ptr<const detail::DefaultValue> value)
+    : m_default(std::move(value)) {}
 
-template <> int Argument::As<int>(std::size_t index) const {
-  return StrToInt(m_values[index]);
+void Argument::Assign(std::span<const std::string_view> values) {
+  m_values.assign(values.begin(), values.end());
+  m_count.reset();
 }
 
-template <> std::vector<int> Argument::AsVector<int>() const {
-  std::vector<int> values;
-  std::transform(m_values.cbegin(), m_values.cend(), std::back_inserter(values),
-                 StrToInt);
-  return values;
+void Argument::Append(std::span<const std::string_view> values) {
+  for (const auto &value : values) {
+    m_values.push_back(value);
+  }
 }
 
-template <> long Argument::As<long>(std::size_t index) const {
-  return StrToLong(m_values[index]);
+void Argument::SetCount(std::size_t count) {
+  m_values.clear();
+  m_count = count;
 }
 
-template <> std::vector<long> Argument::AsVector<long>() const {
-  std::vector<long> values;
-  std::transform(m_values.cbegin(), m_values.cend(), std::back_inserter(values),
-                 StrToLong);
-  return values;
+std::size_t Argument::Size() const {
+  return (m_count.has_value() || (m_default != nullptr)) ? 1 : m_values.size();
 }
 
-template <> float Argument::As<float>(std::size_t index) const {
-  return StrToFloat(m_values[index]);
+void ArgumentMap::Add(const std::string &name, const Argument &arg) {
+  m_map.insert_or_assign(name, Entry{arg});
 }
 
-template <> std::vector<float> Argument::AsVector<float>() const {
-  std::vector<float> values;
-  std::transform(m_values.cbegin(), m_values.cend(), std::back_inserter(values),
-                 StrToFloat);
-  return values;
+void ArgumentMap::Add(std::string_view name,
+                      std::span<const std::string_view> values) {
+  const auto it = m_map.find(name);
+  if (it == m_map.end()) {
+    m_map.emplace(name, Entry{values});
+  } else {
+    it->second.argument.Assign(values);
+    it->second.present = true;
+  }
+}
+
+void ArgumentMap::Append(std::string_view name,
+                         std::span<const std::string_view> values) {
+  const auto it = m_map.find(name);
+  if ((it == m_map.end()) || !it->second.present) {
+    Add(name, values);
+  } else {
+    it->second.argument.Append(values);
+  }
+}
+
+void ArgumentMap::SetCount(std::string_view name, std::size_t count) {
+  const auto it = m_map.find(name);
+  if (it == m_map.end()) {
+    m_map.emplace(name, Entry{std::span<const std::string_view>{}})
+        .first->second.argument.SetCount(count);
+  } else {
+    it->second.argument.SetCount(count);
+    it->second.present = true;
+  }
+}
+
+struct ArgumentMap::LazyState {
+  std::shared_ptr<detail::LazyDefinitions> definitions;
+  std::string storage;                   // All tokens, back to back
+  std::vector<std::string_view> tokens;  // Views into storage
+  std::size_t first = 0;                 // First token after the ignored one
+  std::size_t num_positionals = 0;       // Tokens before the first option
+  std::vector<std::size_t> option_starts; // Indexes of the option tokens
+  std::string env_storage;                // Environment entries read
+  std::vector<std::string_view> env_entries; // "NAME=value", into env_storage
+
+  std::mutex mutex;
+  ArgumentMap resolved;
+  std::unordered_set<std::size_t> resolved_ids;
+  bool positionals_resolved = false;
+  bool validated = false;
+};
+
+void ArgumentMap::Clear() {
+  for (auto &[name, entry] : m_map) {
+    entry.present = false;
+  }
+  m_lazy.reset();
+}
+
+const Argument *ArgumentMap::Find(std::string_view name,
+                                  bool with_defaults) const {
+  if (m_lazy != nullptr) {
+    detail::LazyDefinitions &definitions = *m_lazy->definitions;
+    const std::shared_lock lock(definitions.mutex);
+    return definitions.parser->ResolveLazy(*m_lazy, name, with_defaults);
+  }
+
+  const auto it = m_map.find(name);
+  if ((it != m_map.end()) && it->second.present) {
+    return &it->second.argument;
+  }
+
+  if (with_defaults && (m_defaults != nullptr)) {
+    return m_defaults->Find(name);
+  }
+
+  return nullptr;
+}
+
+bool ArgumentMap::Contains(const std::string &name) const {
+  return (Find(name, false) != nullptr);
+}
+
+const Argument &ArgumentMap::operator[](const std::string &name) const {
+  if (const Argument *argument = Find(name, true)) {
+    return *argument;
+  }
+
+  throw std::runtime_error("Undefined argument " + std::string{name} + ".");
+}
+
+void ArgumentMap::Validate() const {
+  if (m_lazy != nullptr) {
+    detail::LazyDefinitions &definitions = *m_lazy->definitions;
+    const std::shared_lock lock(definitions.mutex);
+    definitions.parser->ValidateLazy(*m_lazy);
+  }
+}
+
+SnapshotPublisher::SnapshotPublisher(ArgumentSnapshot snapshot) {
+  Publish(std::move(snapshot));
+}
+
+void SnapshotPublisher::Publish(ArgumentSnapshot snapshot) {
+  if (snapshot == nullptr) {
+    throw std::runtime_error("Cannot publish an empty snapshot.");
+  }
+
+  // Store before bumping the version, so readers that see the new version
+  // also see the new snapshot.
+  m_snapshot.store(std::move(snapshot), std::memory_order_release);
+  m_version.fetch_add(1, std::memory_order_acq_rel);
+}
+
+ArgumentSnapshot SnapshotPublisher::Load() const {
+  return m_snapshot.load(std::memory_order_acquire);
+}
+
+std::uint64_t SnapshotPublisher::Version() const {
+  return m_version.load(std::memory_order_acquire);
+}
+
+SnapshotPublisher::Reader::Reader(const SnapshotPublisher &publisher)
+    : m_publisher(&publisher), m_version(publisher.Version()),
+      m_snapshot(publisher.Load()) {}
+
+const ArgumentMap &SnapshotPublisher::Reader::Get() {
+  const std::uint64_t version = m_publisher->Version();
+  if (version != m_version) {
+    // Releases the reference to the previous snapshot
+    m_snapshot = m_publisher->Load();
+    m_version = version;
+  }
+
+  return *m_snapshot;
+}
+
+namespace detail {
+
+void BKTree::Insert(std::string_view word) {
+  if (m_nodes.empty()) {
+    m_nodes.push_back({word, {}});
+    return;
+  }
+
+  std::size_t node_index = 0;
+  while (true) {
+    const std::size_t distance = EditDistance(word, m_nodes[node_index].word);
+    if (distance == 0) {
+      return;
+    }
+
+    auto &children = m_nodes[node_index].children;
+    const auto child_it = std::find_if(
+        children.cbegin(), children.cend(),
+        [distance](const auto &child) { return child.first == distance; });
+    if (child_it == children.cend()) {
+      children.emplace_back(distance, m_nodes.size());
+      m_nodes.push_back({word, {}});
+      return;
+    }
+    node_index = child_it->second;
+  }
+}
+
+std::vector<std::string_view>
+BKTree::FindClosest(std::string_view word, std::size_t max_distance,
+                    std::size_t max_results) const {
+  std::vector<std::pair<std::size_t, std::string_view>> matches;
+  if (m_nodes.empty()) {
+    return {};
+  }
+
+  // By the triangle inequality, only children whose edge distance is within
+  // max_distance of the distance to their parent can hold matches.
+  std::vector<std::size_t> pending{0};
+  while (!pending.empty()) {
+    const Node &node = m_nodes[pending.back()];
+    pending.pop_back();
+
+    const std::size_t distance = EditDistance(word, node.word);
+    if (distance <= max_distance) {
+      matches.emplace_back(distance, node.word);
+    }
+
+    for (const auto &[child_distance, child_index] : node.children) {
+      if ((child_distance + max_distance >= distance) &&
+          (child_distance <= distance + max_distance)) {
+        pending.push_back(child_index);
+      }
+    }
+  }
+
+  std::sort(matches.begin(), matches.end());
+  const std::size_t num_results = std::min(matches.size(), max_results);
+  std::vector<std::string_view> results;
+  for (std::size_t i = 0; i < num_results; ++i) {
+    results.push_back(matches[i].second);
+  }
+
+  return results;
+}
+
+} // namespace detail
+
+/* Schema layout. Every field is a native-endian uint32. Offsets are relative
+ * to the start of the blob and strings are stored as {offset, size} pairs
+ * into the string pool.
+ *
+ *   header     NUM_HEADER_FIELDS words, see SchemaField
+ *   positional {name, help, num_args, nargs}
+ *   optional   {first_flag, num_flags, help, num_args, nargs, required,
+ *               action}
+ *   required   optional index
+ *   flag       {name, optional index}
+ *   bucket     flag index + 1, or 0 if empty. Open addressing with linear
+ *              probing on the FNV-1a hash of the flag
+ *   strings    character data
+ */
+enum SchemaField : std::size_t {
+  FIELD_MAGIC,
+  FIELD_VERSION,
+  FIELD_BYTE_ORDER,
+  FIELD_SIZE,
+  FIELD_OPTIONS,
+  FIELD_DESCRIPTION,
+  FIELD_DESCRIPTION_SIZE,
+  FIELD_NUM_POSITIONALS,
+  FIELD_POSITIONALS,
+  FIELD_NUM_OPTIONALS,
+  FIELD_OPTIONALS,
+  FIELD_NUM_REQUIRED,
+  FIELD_REQUIRED,
+  FIELD_NUM_FLAGS,
+  FIELD_FLAGS,
+  FIELD_NUM_BUCKETS,
+  FIELD_BUCKETS,
+  FIELD_STRINGS,
+  FIELD_STRINGS_SIZE,
+  NUM_HEADER_FIELDS,
+};
+
+static constexpr std::uint32_t SCHEMA_MAGIC = 0x43535041; // "APSC"
+static constexpr std::uint32_t SCHEMA_BYTE_ORDER = 0x01020304;
+static constexpr std::uint32_t SCHEMA_IGNORE_FIRST_ARGUMENT = 1;
+
+static constexpr std::size_t WORD_SIZE = sizeof(std::uint32_t);
+static constexpr std::size_t POSITIONAL_WORDS = 6;
+static constexpr std::size_t OPTIONAL_WORDS = 8;
+static constexpr std::size_t REQUIRED_WORDS = 1;
+static constexpr std::size_t FLAG_WORDS = 3;
+static constexpr std::size_t BUCKET_WORDS = 1;
+
+static std::uint64_t Fnv1a(std::string_view str) {
+  std::uint64_t hash = 14695981039346656037ULL;
+  for (const char c : str) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static std::uint32_t ToU32(std::size_t value) {
+  if (value > UINT32_MAX) {
+    throw std::runtime_error("Definition too large for a schema.");
+  }
+  return static_cast<std::uint32_t>(value);
+}
+
+namespace {
+
+// Builds the binary schema format read by Schema.
+class SchemaWriter final {
+public:
+  void Reserve(std::size_t num_optionals, std::size_t num_flags,
+               std::size_t num_string_bytes) {
+    m_optionals.reserve(num_optionals * OPTIONAL_WORDS);
+    m_flags.reserve(num_flags * FLAG_WORDS);
+    m_strings.reserve(num_string_bytes);
+  }
+
+  void SetDescription(std::string_view description) {
+    m_description = AddString(description);
+  }
+
+  void SetIgnoreFirstArgument(bool ignore) {
+    m_options = ignore ? SCHEMA_IGNORE_FIRST_ARGUMENT : 0;
+  }
+
+  void AddPositional(std::string_view name, std::string_view help,
+                     std::pair<NArgs, std::size_t> nargs) {
+    const auto name_ref = AddString(name);
+    const auto help_ref = AddString(help);
+    m_positionals.insert(m_positionals.end(),
+                         {name_ref.first, name_ref.second, help_ref.first,
+                          help_ref.second, ToU32(nargs.second),
+                          static_cast<std::uint32_t>(nargs.first)});
+  }
+
+  // Flags added next belong to this optional.
+  void AddOptional(std::string_view help, std::pair<NArgs, std::size_t> nargs,
+                   bool required, Action action) {
+    const auto help_ref = AddString(help);
+    m_optionals.insert(m_optionals.end(),
+                       {ToU32(m_flags.size() / FLAG_WORDS), 0, help_ref.first,
+                        help_ref.second, ToU32(nargs.second),
+                        static_cast<std::uint32_t>(nargs.first),
+                        required ? 1U : 0U,
+                        static_cast<std::uint32_t>(action)});
+  }
+
+  void AddFlag(std::string_view flag) {
+    const auto flag_ref = AddString(flag);
+    const std::size_t num_optionals = m_optionals.size() / OPTIONAL_WORDS;
+    m_flags.insert(m_flags.end(), {flag_ref.first, flag_ref.second,
+                                   ToU32(num_optionals - 1)});
+    ++m_optionals[m_optionals.size() - OPTIONAL_WORDS + 1];
+  }
+
+  [[nodiscard]] std::vector<std::byte> Finish() const {
+    const std::size_t num_optionals = m_optionals.size() / OPTIONAL_WORDS;
+    std::size_t num_required = 0;
+    for (std::size_t i = 0; i < num_optionals; ++i) {
+      num_required += m_optionals[i * OPTIONAL_WORDS + 6];
+    }
+
+    std::vector<std::uint32_t> required;
+    required.reserve(num_required);
+    for (std::size_t i = 0; i < num_optionals; ++i) {
+      if (m_optionals[i * OPTIONAL_WORDS + 6] != 0) {
+        required.push_back(ToU32(i));
+      }
+    }
+
+    const std::size_t num_flags = m_flags.size() / FLAG_WORDS;
+    const std::size_t num_buckets =
+        (num_flags == 0) ? 0 : std::bit_ceil(2 * num_flags);
+    std::vector<std::uint32_t> buckets(num_buckets, 0);
+    for (std::size_t i = 0; i < num_flags; ++i) {
+      const std::string_view flag = GetString(&m_flags[i * FLAG_WORDS]);
+      std::size_t bucket = Fnv1a(flag) & (num_buckets - 1);
+      while (buckets[bucket] != 0) {
+        const std::size_t other = buckets[bucket] - 1;
+        if (GetString(&m_flags[other * FLAG_WORDS]) == flag) {
+          throw std::runtime_error("Flag " + std::string{flag} +
+                                   " redefined.");
+        }
+        bucket = (bucket + 1) & (num_buckets - 1);
+      }
+      buckets[bucket] = ToU32(i + 1);
+    }
+
+    std::array<std::uint32_t, NUM_HEADER_FIELDS> header{};
+    std::size_t offset = NUM_HEADER_FIELDS * WORD_SIZE;
+    const auto place = [&offset](std::size_t num_words) {
+      const std::size_t section_offset = offset;
+      offset += num_words * WORD_SIZE;
+      return ToU32(section_offset);
+    };
+
+    header[FIELD_MAGIC] = SCHEMA_MAGIC;
+    header[FIELD_VERSION] = Schema::VERSION;
+    header[FIELD_BYTE_ORDER] = SCHEMA_BYTE_ORDER;
+    header[FIELD_OPTIONS] = m_options;
+    header[FIELD_DESCRIPTION] = m_description.first;
+    header[FIELD_DESCRIPTION_SIZE] = m_description.second;
+    header[FIELD_NUM_POSITIONALS] =
+        ToU32(m_positionals.size() / POSITIONAL_WORDS);
+    header[FIELD_POSITIONALS] = place(m_positionals.size());
+    header[FIELD_NUM_OPTIONALS] = ToU32(num_optionals);
+    header[FIELD_OPTIONALS] = place(m_optionals.size());
+    header[FIELD_NUM_REQUIRED] = ToU32(required.size());
+    header[FIELD_REQUIRED] = place(required.size());
+    header[FIELD_NUM_FLAGS] = ToU32(num_flags);
+    header[FIELD_FLAGS] = place(m_flags.size());
+    header[FIELD_NUM_BUCKETS] = ToU32(num_buckets);
+    header[FIELD_BUCKETS] = place(buckets.size());
+    header[FIELD_STRINGS] = ToU32(offset);
+    header[FIELD_STRINGS_SIZE] = ToU32(m_strings.size());
+    header[FIELD_SIZE] = ToU32(offset + m_strings.size());
+
+    std::vector<std::byte> blob(header[FIELD_SIZE]);
+    std::byte *out = blob.data();
+    const auto write = [&out](const auto &words) {
+      const std::size_t num_bytes = words.size() * WORD_SIZE;
+      if (num_bytes > 0) {
+        std::memcpy(out, words.data(), num_bytes);
+      }
+      out += num_bytes;
+    };
+    write(header);
+    write(m_positionals);
+    write(m_optionals);
+    write(required);
+    write(m_flags);
+    write(buckets);
+    if (!m_strings.empty()) {
+      std::memcpy(out, m_strings.data(), m_strings.size());
+    }
+
+    return blob;
+  }
+
+private:
+  std::uint32_t m_options = 0;
+  std::pair<std::uint32_t, std::uint32_t> m_description{0, 0};
+  std::vector<std::uint32_t> m_positionals;
+  std::vector<std::uint32_t> m_optionals;
+  std::vector<std::uint32_t> m_flags;
+  std::string m_strings;
+
+  std::pair<std::uint32_t, std::uint32_t> AddString(std::string_view str) {
+    const std::uint32_t offset = ToU32(m_strings.size());
+    m_strings.append(str);
+    return {offset, ToU32(str.size())};
+  }
+
+  [[nodiscard]] std::string_view GetString(const std::uint32_t *ref) const {
+    return std::string_view{m_strings}.substr(ref[0], ref[1]);
+  }
+};
+
+} // namespace
+
+Schema::Schema(std::span<const std::byte> blob) : m_blob(blob) { Validate(); }
+
+Schema::Schema(std::vector<std::byte> blob) {
+  auto owner = std::make_shared<const std::vector<std::byte>>(std::move(blob));
+  m_blob = *owner;
+  m_owner = std::move(owner);
+  Validate();
+}
+
+#if defined(ARGPARSE_HAS_MMAP)
+// Map all of a descriptor read-only. The mapping is unmapped with its last
+// reference and outlives the descriptor.
+static std::shared_ptr<const void>
+MapDescriptor(int fd, const std::string &what,
+              std::span<const std::byte> &bytes) {
+  struct stat status;
+  if ((::fstat(fd, &status) != 0) || (status.st_size <= 0)) {
+    throw std::runtime_error("Cannot read " + what + ".");
+  }
+
+  const auto size = static_cast<std::size_t>(status.st_size);
+  void *address = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (address == MAP_FAILED) {
+    throw std::runtime_error("Cannot map " + what + ".");
+  }
+
+  bytes = {static_cast<const std::byte *>(address), size};
+  return {address, [size](const void *ptr) {
+            ::munmap(const_cast<void *>(ptr), size);
+          }};
+}
+#endif
+
+Schema Schema::Map(const std::string &path) {
+#if defined(ARGPARSE_HAS_MMAP)
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("Cannot open schema " + path + ".");
+  }
+
+  std::span<const std::byte> bytes;
+  std::shared_ptr<const void> mapping;
+  try {
+    mapping = MapDescriptor(fd, "schema " + path, bytes);
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+  ::close(fd);
+
+  Schema schema{bytes};
+  schema.m_owner = std::move(mapping);
+  return schema;
+#else
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Cannot open schema " + path + ".");
+  }
+
+  std::vector<std::byte> blob;
+  std::transform(std::istreambuf_iterator<char>(file),
+                 std::istreambuf_iterator<char>(), std::back_inserter(blob),
+                 [](char c) { return static_cast<std::byte>(c); });
+  return Schema{std::move(blob)};
+#endif
+}
+
+std::span<const std::byte> Schema::Bytes() const { return m_blob; }
+
+std::string_view Schema::Description() const {
+  return ReadString(FIELD_DESCRIPTION * WORD_SIZE);
+}
+
+bool Schema::IgnoreFirstArgument() const {
+  return ((ReadField(FIELD_OPTIONS) & SCHEMA_IGNORE_FIRST_ARGUMENT) != 0);
+}
+
+std::size_t Schema::NumPositionals() const {
+  return ReadField(FIELD_NUM_POSITIONALS);
+}
+
+// Enums stored in a blob, checked against their last enumerator
+static NArgs ToNArgs(std::uint32_t value) {
+  if (value > static_cast<std::uint32_t>(NArgs::ONE_OR_MORE)) {
+    throw std::runtime_error("Corrupt schema: bad number of arguments.");
+  }
+  return static_cast<NArgs>(value);
+}
+
+static Action ToAction(std::uint32_t value) {
+  if (value > static_cast<std::uint32_t>(Action::COUNT)) {
+    throw std::runtime_error("Corrupt schema: bad action.");
+  }
+  return static_cast<Action>(value);
+}
+
+Schema::PositionalEntry Schema::GetPositional(std::size_t index) const {
+  const std::size_t offset =
+      SectionOffset(FIELD_NUM_POSITIONALS, index, POSITIONAL_WORDS);
+
+  PositionalEntry entry;
+  entry.name = ReadString(offset);
+  entry.help = ReadString(offset + 2 * WORD_SIZE);
+  entry.num_args = ReadU32(offset + 4 * WORD_SIZE);
+  entry.nargs = ToNArgs(ReadU32(offset + 5 * WORD_SIZE));
+  return entry;
+}
+
+std::size_t Schema::NumOptionals() const {
+  return ReadField(FIELD_NUM_OPTIONALS);
+}
+
+Schema::OptionalEntry Schema::GetOptional(std::size_t index) const {
+  const std::size_t offset =
+      SectionOffset(FIELD_NUM_OPTIONALS, index, OPTIONAL_WORDS);
+
+  OptionalEntry entry;
+  entry.first_flag = ReadU32(offset);
+  entry.num_flags = ReadU32(offset + WORD_SIZE);
+  entry.help = ReadString(offset + 2 * WORD_SIZE);
+  entry.num_args = ReadU32(offset + 4 * WORD_SIZE);
+  entry.nargs = ToNArgs(ReadU32(offset + 5 * WORD_SIZE));
+  entry.required = (ReadU32(offset + 6 * WORD_SIZE) != 0);
+  entry.action = ToAction(ReadU32(offset + 7 * WORD_SIZE));
+
+  if (entry.first_flag + entry.num_flags > NumFlags()) {
+    throw std::runtime_error("Corrupt schema: flag index out of range.");
+  }
+  return entry;
+}
+
+std::size_t Schema::NumRequired() const {
+  return ReadField(FIELD_NUM_REQUIRED);
+}
+
+std::size_t Schema::GetRequired(std::size_t index) const {
+  return ReadU32(SectionOffset(FIELD_NUM_REQUIRED, index, REQUIRED_WORDS));
+}
+
+std::size_t Schema::NumFlags() const { return ReadField(FIELD_NUM_FLAGS); }
+
+std::string_view Schema::GetFlag(std::size_t index) const {
+  return ReadString(SectionOffset(FIELD_NUM_FLAGS, index, FLAG_WORDS));
+}
+
+std::optional<std::size_t> Schema::FindOptional(std::string_view flag) const {
+  const std::size_t num_buckets = ReadField(FIELD_NUM_BUCKETS);
+  if (num_buckets == 0) {
+    return std::nullopt;
+  }
+
+  std::size_t bucket = Fnv1a(flag) & (num_buckets - 1);
+  for (std::size_t probe = 0; probe < num_buckets; ++probe) {
+    ARGPARSE_COUNT_OPERATION();
+    const std::uint32_t entry =
+        ReadU32(SectionOffset(FIELD_NUM_BUCKETS, bucket, BUCKET_WORDS));
+    if (entry == 0) {
+      return std::nullopt;
+    }
+
+    const std::size_t flag_offset =
+        SectionOffset(FIELD_NUM_FLAGS, entry - 1, FLAG_WORDS);
+    if (ReadString(flag_offset) == flag) {
+      return ReadU32(flag_offset + 2 * WORD_SIZE);
+    }
+    bucket = (bucket + 1) & (num_buckets - 1);
+  }
+
+  return std::nullopt;
+}
+
+std::uint32_t Schema::ReadField(std::size_t field) const {
+  return ReadU32(field * WORD_SIZE);
+}
+
+std::uint32_t Schema::ReadU32(std::size_t offset) const {
+  std::uint32_t value;
+  std::memcpy(&value, m_blob.data() + offset, sizeof(value));
+  return value;
+}
+
+std::string_view Schema::ReadString(std::size_t offset) const {
+  const std::size_t string_offset = ReadU32(offset);
+  const std::size_t string_size = ReadU32(offset + WORD_SIZE);
+  if (string_offset + string_size > ReadField(FIELD_STRINGS_SIZE)) {
+    throw std::runtime_error("Corrupt schema: string out of range.");
+  }
+
+  const std::size_t strings = ReadField(FIELD_STRINGS);
+  return {reinterpret_cast<const char *>(m_blob.data()) + strings +
+              string_offset,
+          string_size};
+}
+
+std::size_t Schema::SectionOffset(std::size_t field, std::size_t index,
+                                  std::size_t record_words) const {
+  if (index >= ReadField(field)) {
+    throw std::out_of_range("Schema index out of range.");
+  }
+  return ReadField(field + 1) + index * record_words * WORD_SIZE;
+}
+
+// Checks the header and that every section lies within the blob. Records
+// are checked as they are read.
+void Schema::Validate() const {
+  if (m_blob.size() < NUM_HEADER_FIELDS * WORD_SIZE) {
+    throw std::runtime_error("Invalid schema: too small.");
+  } else if (ReadField(FIELD_MAGIC) != SCHEMA_MAGIC) {
+    throw std::runtime_error("Invalid schema: bad magic number.");
+  } else if (ReadField(FIELD_BYTE_ORDER) != SCHEMA_BYTE_ORDER) {
+    throw std::runtime_error("Invalid schema: wrong byte order.");
+  } else if (ReadField(FIELD_VERSION) != VERSION) {
+    throw std::runtime_error("Unsupported schema version " +
+                             std::to_string(ReadField(FIELD_VERSION)) + ".");
+  }
+
+  const std::size_t size = ReadField(FIELD_SIZE);
+  if (size > m_blob.size()) {
+    throw std::runtime_error("Invalid schema: truncated.");
+  }
+
+  const std::array<std::pair<SchemaField, std::size_t>, 5> sections{{
+      {FIELD_NUM_POSITIONALS, POSITIONAL_WORDS},
+      {FIELD_NUM_OPTIONALS, OPTIONAL_WORDS},
+      {FIELD_NUM_REQUIRED, REQUIRED_WORDS},
+      {FIELD_NUM_FLAGS, FLAG_WORDS},
+      {FIELD_NUM_BUCKETS, BUCKET_WORDS},
+  }};
+  for (const auto &[field, record_words] : sections) {
+    const std::uint64_t count = ReadField(field);
+    const std::uint64_t offset = ReadField(field + 1);
+    if (offset + count * record_words * WORD_SIZE > size) {
+      throw std::runtime_error("Invalid schema: section out of range.");
+    }
+  }
+
+  const std::uint64_t strings = ReadField(FIELD_STRINGS);
+  const std::uint64_t strings_size = ReadField(FIELD_STRINGS_SIZE);
+  const std::uint32_t num_buckets = ReadField(FIELD_NUM_BUCKETS);
+  if (strings + strings_size > size) {
+    throw std::runtime_error("Invalid schema: section out of range.");
+  } else if (!std::has_single_bit(num_buckets) && (num_buckets != 0)) {
+    throw std::runtime_error("Invalid schema: bad hash table size.");
+  }
+}
+
+/* ArgumentView layout, in the conventions of the schema layout.
+ *
+ *   header  NUM_VIEW_FIELDS words, see ViewField
+ *   entry   {name, first_value, num_values, options, count}, one per name
+ *           of each argument, e.g. every flag of an optional
+ *   value   string
+ *   bucket  entry index + 1, or 0 if empty. Open addressing with linear
+ *           probing on the FNV-1a hash of the name
+ *   strings character data
+ */
+enum ViewField : std::size_t {
+  VIEW_MAGIC,
+  VIEW_VERSION,
+  VIEW_BYTE_ORDER,
+  VIEW_SIZE,
+  VIEW_NUM_ENTRIES,
+  VIEW_ENTRIES,
+  VIEW_NUM_VALUES,
+  VIEW_VALUES,
+  VIEW_NUM_BUCKETS,
+  VIEW_BUCKETS,
+  VIEW_STRINGS,
+  VIEW_STRINGS_SIZE,
+  NUM_VIEW_FIELDS,
+};
+
+static constexpr std::uint32_t VIEW_MAGIC_NUMBER = 0x4D415041; // "APAM"
+static constexpr std::uint32_t ENTRY_PRESENT = 1;
+static constexpr std::uint32_t ENTRY_COUNT = 2;
+
+static constexpr std::size_t ENTRY_WORDS = 6;
+static constexpr std::size_t VALUE_WORDS = 2;
+
+std::vector<std::byte> ArgumentMap::Serialize() const {
+  if (m_lazy != nullptr) {
+    Validate();
+    return m_lazy->resolved.Serialize();
+  }
+
+  std::vector<std::uint32_t> entries;
+  std::vector<std::uint32_t> values;
+  std::string strings;
+  const auto add_string = [&strings](std::string_view str) {
+    const std::uint32_t offset = ToU32(strings.size());
+    strings.append(str);
+    return std::pair{offset, ToU32(str.size())};
+  };
+  const auto add_entry = [&](std::string_view name, const Argument &argument,
+                             bool present) {
+    const auto name_ref = add_string(name);
+    std::uint32_t options = present ? ENTRY_PRESENT : 0;
+    std::size_t count = 0;
+    const std::size_t first_value = values.size() / VALUE_WORDS;
+    if (argument.m_count.has_value()) {
+      options |= ENTRY_COUNT;
+      count = *argument.m_count;
+    } else if (argument.m_default != nullptr) {
+      const auto value_ref = add_string(argument.m_default->ToString());
+      values.insert(values.end(), {value_ref.first, value_ref.second});
+    } else {
+      for (const auto &value : argument.m_values) {
+        const auto value_ref = add_string(value);
+        values.insert(values.end(), {value_ref.first, value_ref.second});
+      }
+    }
+    entries.insert(entries.end(),
+                   {name_ref.first, name_ref.second, ToU32(first_value),
+                    ToU32(values.size() / VALUE_WORDS - first_value), options,
+                    ToU32(count)});
+  };
+
+  for (const auto &[name, entry] : m_map) {
+    if (entry.present) {
+      add_entry(name, entry.argument, true);
+    }
+  }
+  for (const detail::Defaults *layer = m_defaults.get(); layer != nullptr;
+       layer = layer->base.get()) {
+    for (const auto &[name, argument] : layer->arguments) {
+      const auto it = m_map.find(name);
+      if ((it == m_map.end()) || !it->second.present) {
+        add_entry(name, argument, false);
+      }
+    }
+  }
+
+  const std::size_t num_entries = entries.size() / ENTRY_WORDS;
+  const std::size_t num_buckets =
+      (num_entries == 0) ? 0 : std::bit_ceil(2 * num_entries);
+  std::vector<std::uint32_t> buckets(num_buckets, 0);
+  for (std::size_t i = 0; i < num_entries; ++i) {
+    const std::uint32_t *name_ref = &entries[i * ENTRY_WORDS];
+    const std::string_view name =
+        std::string_view{strings}.substr(name_ref[0], name_ref[1]);
+    std::size_t bucket = Fnv1a(name) & (num_buckets - 1);
+    while (buckets[bucket] != 0) {
+      bucket = (bucket + 1) & (num_buckets - 1);
+    }
+    buckets[bucket] = ToU32(i + 1);
+  }
+
+  std::array<std::uint32_t, NUM_VIEW_FIELDS> header{};
+  std::size_t offset = NUM_VIEW_FIELDS * WORD_SIZE;
+  const auto place = [&offset](std::size_t num_words) {
+    const std::size_t section_offset = offset;
+    offset += num_words * WORD_SIZE;
+    return ToU32(section_offset);
+  };
+
+  header[VIEW_MAGIC] = VIEW_MAGIC_NUMBER;
+  header[VIEW_VERSION] = ArgumentView::VERSION;
+  header[VIEW_BYTE_ORDER] = SCHEMA_BYTE_ORDER;
+  header[VIEW_NUM_ENTRIES] = ToU32(num_entries);
+  header[VIEW_ENTRIES] = place(entries.size());
+  header[VIEW_NUM_VALUES] = ToU32(values.size() / VALUE_WORDS);
+  header[VIEW_VALUES] = place(values.size());
+  header[VIEW_NUM_BUCKETS] = ToU32(num_buckets);
+  header[VIEW_BUCKETS] = place(buckets.size());
+  header[VIEW_STRINGS] = ToU32(offset);
+  header[VIEW_STRINGS_SIZE] = ToU32(strings.size());
+  header[VIEW_SIZE] = ToU32(offset + strings.size());
+
+  std::vector<std::byte> blob(header[VIEW_SIZE]);
+  std::byte *out = blob.data();
+  const auto write = [&out](const auto &words) {
+    const std::size_t num_bytes = words.size() * WORD_SIZE;
+    if (num_bytes > 0) {
+      std::memcpy(out, words.data(), num_bytes);
+    }
+    out += num_bytes;
+  };
+  write(header);
+  write(entries);
+  write(values);
+  write(buckets);
+  if (!strings.empty()) {
+    std::memcpy(out, strings.data(), strings.size());
+  }
+
+  return blob;
+}
+
+int ArgumentMap::SerializeToMemory() const {
+  const std::vector<std::byte> blob = Serialize();
+#if defined(ARGPARSE_HAS_MMAP)
+#if defined(MFD_ALLOW_SEALING)
+  const int fd = ::memfd_create("argparse", MFD_ALLOW_SEALING);
+#else
+  // An unlinked shared memory object behaves as an anonymous file
+  const std::string name = "/argparse-" + std::to_string(::getpid()) + "-" +
+                           std::to_string(reinterpret_cast<std::uintptr_t>(
+                               blob.data()));
+  const int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0) {
+    ::shm_unlink(name.c_str());
+  }
+#endif
+  if (fd < 0) {
+    throw std::runtime_error("Cannot create shared memory for arguments.");
+  }
+
+  void *address = MAP_FAILED;
+  if (::ftruncate(fd, static_cast<::off_t>(blob.size())) == 0) {
+    address = ::mmap(nullptr, blob.size(), PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (address == MAP_FAILED) {
+    ::close(fd);
+    throw std::runtime_error("Cannot write arguments to shared memory.");
+  }
+  std::memcpy(address, blob.data(), blob.size());
+  ::munmap(address, blob.size());
+
+#if defined(MFD_ALLOW_SEALING)
+  // Readers may rely on the contents never changing
+  ::fcntl(fd, F_ADD_SEALS,
+          F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+  return fd;
+#else
+  throw std::runtime_error("Shared memory is not supported on this platform.");
+#endif
+}
+
+std::size_t ArgumentView::Value::Size() const {
+  return m_count.has_value() ? 1 : m_num_values;
+}
+
+std::string_view ArgumentView::Value::Get(std::size_t index) const {
+  if (index >= m_num_values) {
+    throw std::out_of_range("Argument index out of range.");
+  }
+  return m_view->ReadString(
+      m_view->SectionOffset(VIEW_NUM_VALUES, m_first_value + index,
+                            VALUE_WORDS));
+}
+
+ArgumentView::ArgumentView(std::span<const std::byte> blob) : m_blob(blob) {
+  Validate();
+}
+
+ArgumentView::ArgumentView(std::vector<std::byte> blob) {
+  auto owner = std::make_shared<const std::vector<std::byte>>(std::move(blob));
+  m_blob = *owner;
+  m_owner = std::move(owner);
+  Validate();
+}
+
+ArgumentView ArgumentView::Map(int fd) {
+#if defined(ARGPARSE_HAS_MMAP)
+  std::span<const std::byte> bytes;
+  std::shared_ptr<const void> mapping = MapDescriptor(fd, "arguments", bytes);
+  ArgumentView view{bytes};
+  view.m_owner = std::move(mapping);
+  return view;
+#else
+  static_cast<void>(fd);
+  throw std::runtime_error("Mapping is not supported on this platform.");
+#endif
+}
+
+std::span<const std::byte> ArgumentView::Bytes() const { return m_blob; }
+
+bool ArgumentView::Contains(std::string_view name) const {
+  const auto entry = FindEntry(name);
+  return entry.has_value() &&
+         ((ReadU32(*entry + 4 * WORD_SIZE) & ENTRY_PRESENT) != 0);
+}
+
+ArgumentView::Value ArgumentView::operator[](std::string_view name) const {
+  const auto entry = FindEntry(name);
+  if (!entry.has_value()) {
+    throw std::runtime_error("Undefined argument " + std::string{name} + ".");
+  }
+
+  Value value;
+  value.m_view = this;
+  value.m_first_value = ReadU32(*entry + 2 * WORD_SIZE);
+  value.m_num_values = ReadU32(*entry + 3 * WORD_SIZE);
+  if ((ReadU32(*entry + 4 * WORD_SIZE) & ENTRY_COUNT) != 0) {
+    value.m_count = ReadU32(*entry + 5 * WORD_SIZE);
+  }
+  return value;
+}
+
+std::optional<std::size_t>
+ArgumentView::FindEntry(std::string_view name) const {
+  const std::size_t num_buckets = ReadField(VIEW_NUM_BUCKETS);
+  if (num_buckets == 0) {
+    return std::nullopt;
+  }
+
+  std::size_t bucket = Fnv1a(name) & (num_buckets - 1);
+  for (std::size_t probe = 0; probe < num_buckets; ++probe) {
+    const std::uint32_t entry =
+        ReadU32(SectionOffset(VIEW_NUM_BUCKETS, bucket, BUCKET_WORDS));
+    if (entry == 0) {
+      return std::nullopt;
+    }
+
+    const std::size_t entry_offset =
+        SectionOffset(VIEW_NUM_ENTRIES, entry - 1, ENTRY_WORDS);
+    if (ReadString(entry_offset) == name) {
+      return entry_offset;
+    }
+    bucket = (bucket + 1) & (num_buckets - 1);
+  }
+
+  return std::nullopt;
+}
+
+std::uint32_t ArgumentView::ReadField(std::size_t field) const {
+  return ReadU32(field * WORD_SIZE);
+}
+
+std::uint32_t ArgumentView::ReadU32(std::size_t offset) const {
+  std::uint32_t value;
+  std::memcpy(&value, m_blob.data() + offset, sizeof(value));
+  return value;
+}
+
+std::string_view ArgumentView::ReadString(std::size_t offset) const {
+  const std::size_t string_offset = ReadU32(offset);
+  const std::size_t string_size = ReadU32(offset + WORD_SIZE);
+  if (string_offset + string_size > ReadField(VIEW_STRINGS_SIZE)) {
+    throw std::runtime_error("Corrupt arguments: string out of range.");
+  }
+
+  const std::size_t strings = ReadField(VIEW_STRINGS);
+  return {reinterpret_cast<const char *>(m_blob.data()) + strings +
+              string_offset,
+          string_size};
+}
+
+std::size_t ArgumentView::SectionOffset(std::size_t field, std::size_t index,
+                                        std::size_t record_words) const {
+  if (index >= ReadField(field)) {
+    throw std::out_of_range("Argument index out of range.");
+  }
+  return ReadField(field + 1) + index * record_words * WORD_SIZE;
+}
+
+// Checks the header and that every section lies within the blob. Records
+// are checked as they are read.
+void ArgumentView::Validate() const {
+  if (m_blob.size() < NUM_VIEW_FIELDS * WORD_SIZE) {
+    throw std::runtime_error("Invalid arguments: too small.");
+  } else if (ReadField(VIEW_MAGIC) != VIEW_MAGIC_NUMBER) {
+    throw std::runtime_error("Invalid arguments: bad magic number.");
+  } else if (ReadField(VIEW_BYTE_ORDER) != SCHEMA_BYTE_ORDER) {
+    throw std::runtime_error("Invalid arguments: wrong byte order.");
+  } else if (ReadField(VIEW_VERSION) != VERSION) {
+    throw std::runtime_error("Unsupported arguments version " +
+                             std::to_string(ReadField(VIEW_VERSION)) + ".");
+  }
+
+  const std::size_t size = ReadField(VIEW_SIZE);
+  if (size > m_blob.size()) {
+    throw std::runtime_error("Invalid arguments: truncated.");
+  }
+
+  const std::array<std::pair<ViewField, std::size_t>, 3> sections{{
+      {VIEW_NUM_ENTRIES, ENTRY_WORDS},
+      {VIEW_NUM_VALUES, VALUE_WORDS},
+      {VIEW_NUM_BUCKETS, BUCKET_WORDS},
+  }};
+  for (const auto &[field, record_words] : sections) {
+    const std::uint64_t count = ReadField(field);
+    const std::uint64_t offset = ReadField(field + 1);
+    if (offset + count * record_words * WORD_SIZE > size) {
+      throw std::runtime_error("Invalid arguments: section out of range.");
+    }
+  }
+
+  const std::uint64_t strings = ReadField(VIEW_STRINGS);
+  const std::uint64_t strings_size = ReadField(VIEW_STRINGS_SIZE);
+  const std::uint32_t num_buckets = ReadField(VIEW_NUM_BUCKETS);
+  if (strings + strings_size > size) {
+    throw std::runtime_error("Invalid arguments: section out of range.");
+  } else if (!std::has_single_bit(num_buckets) && (num_buckets != 0)) {
+    throw std::runtime_error("Invalid arguments: bad hash table size.");
+  }
+}
+
+namespace detail {
+
+const Argument *Defaults::Find(std::string_view name) const {
+  const auto it = arguments.find(name);
+  if (it != arguments.end()) {
+    return &it->second;
+  }
+  return (base != nullptr) ? base->Find(name) : nullptr;
+}
+
+std::string_view OptionalRef::Flag(std::size_t index) const {
+  if (optional != nullptr) {
+    return optional->flags[index];
+  } else if (table_flags != nullptr) {
+    return table_flags[index].flag;
+  }
+  return schema->GetFlag(first_flag + index);
+}
+
+std::string_view PositionalRef::Name() const {
+  return (positional != nullptr) ? std::string_view{positional->name}
+                                 : entry.name;
+}
+
+std::string_view PositionalRef::Help() const {
+  return (positional != nullptr) ? std::string_view{positional->help}
+                                 : entry.help;
+}
+
+std::pair<NArgs, std::size_t> PositionalRef::GetNArgs() const {
+  return (positional != nullptr) ? positional->GetNArgs()
+                                 : std::pair{entry.nargs, entry.num_args};
+}
+
+const Binder *PositionalRef::GetBinder() const {
+  return ((positional != nullptr) && positional->binder) ? &positional->binder
+                                                         : nullptr;
+}
+
+} // namespace detail
+
+static detail::OptionalRef MakeRef(const Optional &optional) {
+  detail::OptionalRef ref;
+  ref.id = optional.id;
+  ref.nargs = optional.nargs;
+  ref.num_args = optional.num_args;
+  ref.required = optional.required;
+  ref.action = optional.action;
+  ref.help = optional.help;
+  ref.binder = optional.binder ? &optional.binder : nullptr;
+  ref.num_flags = optional.flags.size();
+  ref.optional = &optional;
+  return ref;
+}
+
+static detail::OptionalRef MakeRef(const Schema &schema, std::size_t index,
+                                   std::size_t first_id) {
+  const auto entry = schema.GetOptional(index);
+
+  detail::OptionalRef ref;
+  ref.id = first_id + index;
+  ref.nargs = entry.nargs;
+  ref.num_args = entry.num_args;
+  ref.required = entry.required;
+  ref.action = entry.action;
+  ref.help = entry.help;
+  ref.num_flags = entry.num_flags;
+  ref.schema = &schema;
+  ref.first_flag = entry.first_flag;
+  return ref;
+}
+
+detail::ParserCore::ParserCore(const std::string &description)
+    : m_program_description(description) {}
+
+detail::ParserCore::ParserCore(const Schema &schema)
+    : m_program_description(schema.Description()),
+      m_ignore_first_argument(schema.IgnoreFirstArgument()) {
+  AttachSchema(schema);
 }
 
-template <> double Argument::As<double>(std::size_t index) const {
-  return StrToDouble(m_values[index]);
+detail::ParserCore::ParserCore(const ParserCore &other)
+    : std::enable_shared_from_this<ParserCore>(),
+      m_program_description(other.m_program_description),
+      m_ignore_first_argument(other.m_ignore_first_argument),
+      m_base(other.m_base), m_positionals(other.m_positionals),
+      m_optionals(other.m_optionals),
+      m_schemas(other.m_schemas), m_table_strings(other.m_table_strings),
+      m_table_optionals(other.m_table_optionals),
+      m_table_flags(other.m_table_flags), m_table_index(other.m_table_index),
+      m_table_required(other.m_table_required),
+      m_generation(other.m_generation),
+      m_cache_capacity(other.m_cache_capacity),
+      m_defaults(other.m_defaults),
+      m_positional_order(other.m_positional_order),
+      m_num_optionals(other.m_num_optionals),
+      m_positional_names(other.m_positional_names),
+      m_constraints(other.m_constraints),
+      m_constraint_masks(other.m_constraint_masks) {
+  // Point the copied definitions at this parser. Those of the base come
+  // first and are shared.
+  auto positional = m_positionals.begin();
+  const std::size_t num_base_positionals =
+      (m_base != nullptr) ? m_base->m_positional_order.size() : 0;
+  const auto own_order =
+      std::span{m_positional_order}.subspan(num_base_positionals);
+  for (auto &ref : own_order) {
+    if (ref.positional != nullptr) {
+      ref.positional = &*positional++;
+    }
+  }
+  for (auto &copy : m_positionals) {
+    copy.owner = this;
+  }
+  for (auto &optional : m_optionals) {
+    optional.owner = this;
+    for (const auto &flag : optional.flags) {
+      m_flags_map.emplace(flag, optional);
+    }
+    if (optional.required) {
+      m_required_optionals.push_back(&optional);
+    }
+  }
 }
 
-template <> std::vector<double> Argument::AsVector<double>() const {
-  std::vector<double> values;
-  std::transform(m_values.cbegin(), m_values.cend(), std::back_inserter(values),
-                 StrToDouble);
-  return values;
+std::shared_ptr<detail::ParserCore>
+detail::ParserCore::Extend(std::shared_ptr<const ParserCore> core) {
+  if (core->m_base != nullptr) {
+    return std::make_shared<ParserCore>(*core);
+  }
+
+  auto layer = std::make_shared<ParserCore>(core->m_program_description);
+  layer->m_ignore_first_argument = core->m_ignore_first_argument;
+  layer->m_cache_capacity = core->m_cache_capacity;
+  layer->m_defaults->base = core->m_defaults;
+  layer->m_positional_order = core->m_positional_order;
+  layer->m_num_optionals = core->m_num_optionals;
+  layer->m_base = std::move(core);
+  return layer;
 }
 
-void ArgumentMap::Add(const std::string &name, const Argument &arg) {
-  m_map.insert_or_assign(name, arg);
+void detail::ParserCore::Touch() {
+  ++m_generation;
+
+  // Lazy maps parsed so far keep the definitions as they are now
+  std::shared_ptr<LazyDefinitions> lazy;
+  {
+    const std::lock_guard lock(m_lazy_mutex);
+    lazy = std::exchange(m_lazy_definitions, {}).lock();
+  }
+  if (lazy != nullptr) {
+    auto copy = std::make_shared<const ParserCore>(*this);
+    const std::unique_lock lock(lazy->mutex);
+    lazy->parser = std::move(copy);
+  }
 }
 
-bool ArgumentMap::Contains(const std::string &name) const {
-  return m_map.contains(name);
+bool detail::ParserCore::IsShared() const {
+  std::shared_ptr<LazyDefinitions> lazy;
+  {
+    const std::lock_guard lock(m_lazy_mutex);
+    lazy = m_lazy_definitions.lock();
+  }
+  // Lazy maps hold the core as well, but let go of it on the next change
+  return weak_from_this().use_count() > ((lazy != nullptr) ? 2 : 1);
 }
 
-const Argument &ArgumentMap::operator[](const std::string &name) const {
-  const auto it = m_map.find(name);
-  if (it == m_map.end()) {
-    throw std::runtime_error("Undefined argument " + std::string{name} + ".");
+void detail::ParserCore::UpdateRequired(const Optional &optional) {
+  const auto it = std::lower_bound(
+      m_required_optionals.begin(), m_required_optionals.end(), optional.id,
+      [](const Optional *other, std::size_t id) { return other->id < id; });
+  const bool listed = (it != m_required_optionals.end()) && (*it == &optional);
+  if (optional.required && !listed) {
+    m_required_optionals.insert(it, &optional);
+  } else if (!optional.required && listed) {
+    m_required_optionals.erase(it);
   }
+}
 
-  return it->second;
+// Parses hold the defaults they saw, so they are copied while shared
+detail::Defaults &detail::ParserCore::MutableDefaults() {
+  if (m_defaults.use_count() > 1) {
+    m_defaults = std::make_shared<Defaults>(*m_defaults);
+  }
+  return *m_defaults;
 }
 
-ArgumentParser::ArgumentParser(const std::string &description)
-    : m_program_description(description) {}
+void detail::ParserCore::SetDefault(
+    std::span<const std::string> names,
+    const std::shared_ptr<const DefaultValue> &value) {
+  Touch();
+  Defaults &defaults = MutableDefaults();
+  for (const auto &name : names) {
+    defaults.arguments.insert_or_assign(name, Argument{value});
+  }
+}
 
-void ArgumentParser::IgnoreFirstArgument(bool ignore) {
+void detail::ParserCore::IgnoreFirstArgument(bool ignore) {
+  Touch();
   m_ignore_first_argument = ignore;
 }
 
-Positional &ArgumentParser::AddPositional(const std::string &name) {
-  if (m_positional_names.contains(name)) {
+Positional &detail::ParserCore::AddPositional(const std::string &name) {
+  if (HasPositional(name)) {
     throw std::runtime_error("Argument name " + std::string{name} +
                              " redefined.");
   }
+  Touch();
   m_positional_names.insert(name);
 
   Positional &positional = m_positionals.emplace_back(name);
+  positional.owner = this;
+  m_positional_order.push_back({&positional, {}});
   return positional;
 }
 
 Optional &
-ArgumentParser::AddOptional(std::initializer_list<std::string> flags) {
+detail::ParserCore::AddOptional(std::initializer_list<std::string> flags) {
+  // Check the flags first, so a failed definition leaves nothing behind
+  for (auto it = flags.begin(); it != flags.end(); ++it) {
+    if (HasFlag(*it) || (std::find(flags.begin(), it, *it) != it)) {
+      throw std::runtime_error("Flag " + *it + " redefined.");
+    }
+  }
+
+  Touch();
   Optional &optional = m_optionals.emplace_back(flags);
+  optional.owner = this;
+  optional.id = m_num_optionals++;
+  for (const auto &flag : flags) {
+    m_flags_map.emplace(flag, optional);
+  }
+  m_flags_index.reset();
+
+  return optional;
+}
+
+Optional &detail::ParserCore::AddOptional(const std::string &flag) {
+  return AddOptional(std::initializer_list<std::string>{flag});
+}
+
+void detail::ParserCore::AddMutuallyExclusive(
+    std::initializer_list<std::string> flags, bool required) {
+  if (flags.size() < 2) {
+    throw std::runtime_error(
+        "Mutually exclusive groups need at least two options.");
+  }
+
+  AddConstraint(required ? Constraint::Kind::REQUIRED_EXCLUSIVE
+                         : Constraint::Kind::EXCLUSIVE,
+                flags);
+}
+
+void detail::ParserCore::AddDependency(
+    const std::string &flag, std::initializer_list<std::string> dependencies) {
+  if (dependencies.size() == 0) {
+    throw std::runtime_error("Option " + flag + " needs a dependency.");
+  }
+
+  std::vector<std::string> flags{flag};
+  flags.insert(flags.end(), dependencies.begin(), dependencies.end());
+  AddConstraint(Constraint::Kind::DEPENDENCY, std::move(flags));
+}
 
+void detail::ParserCore::AddConstraint(Constraint::Kind kind,
+                                       std::vector<std::string> flags) {
+  std::vector<std::size_t> ids;
+  ids.reserve(flags.size());
   for (const auto &flag : flags) {
-    if (m_flags_map.contains(flag)) {
-      throw std::runtime_error("Flag " + std::string{flag} + " redefined.");
+    const auto optional = FindOptional(flag);
+    if (!optional.has_value()) {
+      throw std::runtime_error("Undefined option " + flag + ".");
+    }
+    ids.push_back(optional->id);
+  }
+  Touch();
+
+  Constraint constraint{.kind = kind, .flags = std::move(flags)};
+  const auto mask_ids = std::span{ids}.subspan(
+      (kind == Constraint::Kind::DEPENDENCY) ? 1 : 0);
+  if (kind == Constraint::Kind::DEPENDENCY) {
+    constraint.trigger = ids.front();
+  }
+
+  const auto [min_id, max_id] = std::ranges::minmax(mask_ids);
+  constraint.first_word = min_id / 64;
+  constraint.num_words = (max_id / 64) - constraint.first_word + 1;
+  constraint.mask = m_constraint_masks.size();
+  m_constraint_masks.resize(constraint.mask + constraint.num_words, 0);
+  for (const std::size_t id : mask_ids) {
+    const std::size_t word = (id / 64) - constraint.first_word;
+    m_constraint_masks[constraint.mask + word] |= std::uint64_t{1} << (id % 64);
+  }
+
+  m_constraints.push_back(std::move(constraint));
+}
+
+void detail::ParserCore::AttachSchema(const Schema &schema) {
+  Touch();
+  const std::size_t num_positionals = schema.NumPositionals();
+  for (std::size_t i = 0; i < num_positionals; ++i) {
+    const auto entry = schema.GetPositional(i);
+    if (HasPositional(entry.name)) {
+      throw std::runtime_error("Argument name " + std::string{entry.name} +
+                               " redefined.");
+    }
+    m_positional_names.emplace(entry.name);
+    m_positional_order.push_back({nullptr, entry});
+  }
+
+  // Flags of a schema are unique. Only check them against earlier
+  // definitions when there are any, to keep attaching a schema O(1).
+  if (m_num_optionals > 0) {
+    const std::size_t num_flags = schema.NumFlags();
+    for (std::size_t i = 0; i < num_flags; ++i) {
+      const std::string_view flag = schema.GetFlag(i);
+      if (HasFlag(flag)) {
+        throw std::runtime_error("Flag " + std::string{flag} + " redefined.");
+      }
+    }
+  }
+
+  m_schemas.push_back({schema, m_num_optionals});
+  m_num_optionals += schema.NumOptionals();
+  m_flags_index.reset();
+}
+
+bool detail::ParserCore::HasPositional(std::string_view name) const {
+  return m_positional_names.contains(name) ||
+         ((m_base != nullptr) && m_base->HasPositional(name));
+}
+
+bool detail::ParserCore::HasFlag(std::string_view flag) const {
+  return FindOptional(flag).has_value();
+}
+
+// A number is a value unless it is a registered flag such as -1
+bool detail::ParserCore::IsOption(std::string_view token) const {
+  return token.starts_with("-") && (!IsNumber(token) || HasFlag(token));
+}
+
+std::optional<detail::OptionalRef>
+detail::ParserCore::FindOptional(std::string_view flag) const {
+  ARGPARSE_COUNT_OPERATION();
+  const auto it = m_flags_map.find(flag);
+  if (it != m_flags_map.end()) {
+    return MakeRef(it->second);
+  }
+  if (const auto index = FindTableFlag(flag)) {
+    return TableRef(m_table_flags[*index].optional);
+  }
+
+  for (const auto &attached : m_schemas) {
+    ARGPARSE_COUNT_OPERATION();
+    const auto index = attached.schema.FindOptional(flag);
+    if (index.has_value()) {
+      return MakeRef(attached.schema, *index, attached.first_id);
+    }
+  }
+
+  return (m_base != nullptr) ? m_base->FindOptional(flag) : std::nullopt;
+}
+
+void detail::ParserCore::ForEachOptional(
+    const std::function<void(const detail::OptionalRef &)> &visit) const {
+  if (m_base != nullptr) {
+    m_base->ForEachOptional(visit);
+  }
+
+  // Merge the three kinds of definitions by id
+  static constexpr std::size_t NONE = std::numeric_limits<std::size_t>::max();
+  auto optional_it = m_optionals.cbegin();
+  auto schema_it = m_schemas.cbegin();
+  std::size_t table_index = 0;
+  while (true) {
+    const std::size_t optional_id =
+        (optional_it != m_optionals.cend()) ? optional_it->id : NONE;
+    const std::size_t schema_id =
+        (schema_it != m_schemas.cend()) ? schema_it->first_id : NONE;
+    const std::size_t table_id = (table_index < m_table_optionals.size())
+                                     ? m_table_optionals[table_index].id
+                                     : NONE;
+    const std::size_t next_id = std::min({optional_id, schema_id, table_id});
+    if (next_id == NONE) {
+      break;
+    }
+
+    if (next_id == schema_id) {
+      const std::size_t num_optionals = schema_it->schema.NumOptionals();
+      for (std::size_t i = 0; i < num_optionals; ++i) {
+        visit(MakeRef(schema_it->schema, i, schema_it->first_id));
+      }
+      ++schema_it;
+    } else if (next_id == table_id) {
+      visit(TableRef(table_index++));
     } else {
-      m_flags_map.emplace(flag, optional);
+      visit(MakeRef(*optional_it));
+      ++optional_it;
+    }
+  }
+}
+
+// Number of arguments of a table optional, checked as Optional checks them
+static std::pair<NArgs, std::size_t> SpecNArgs(const OptionalSpec &spec) {
+  if (spec.action == Action::COUNT) {
+    return {NArgs::NUMERIC, 0};
+  }
+
+  const auto nargs = ParseNArgs(spec.nargs);
+  if ((spec.action == Action::APPEND) && (nargs.first != NArgs::NUMERIC)) {
+    throw std::runtime_error(
+        "Appended optionals need a numeric number of arguments.");
+  } else if (spec.required && ((nargs.first == NArgs::OPTIONAL) ||
+                               (nargs.first == NArgs::ZERO_OR_MORE))) {
+    throw std::runtime_error("An optional argument cannot be made required.");
+  }
+  return nargs;
+}
+
+// Make room for more elements, growing geometrically across calls
+template <typename T>
+static void ReserveMore(std::vector<T> &vector, std::size_t more) {
+  const std::size_t size = vector.size() + more;
+  if (size > vector.capacity()) {
+    vector.reserve(std::max(size, 2 * vector.capacity()));
+  }
+}
+
+void detail::ParserCore::AddOptionals(std::span<const OptionalSpec> table) {
+  const auto for_each_flag = [](std::string_view flags, auto &&visit) {
+    std::size_t pos = 0;
+    while (true) {
+      pos = flags.find_first_not_of(" ,", pos);
+      if (pos == std::string_view::npos) {
+        break;
+      }
+      const std::size_t end = std::min(flags.find_first_of(" ,", pos),
+                                       flags.size());
+      visit(flags.substr(pos, end - pos));
+      pos = end;
+    }
+  };
+
+  // Check the whole table before changing anything
+  std::size_t num_flags = 0;
+  std::size_t num_string_bytes = 0;
+  std::size_t num_required = 0;
+  for (const auto &spec : table) {
+    static_cast<void>(SpecNArgs(spec));
+    std::size_t num_spec_flags = 0;
+    for_each_flag(spec.flags, [&](std::string_view flag) {
+      if (!IsValidFlagName(flag)) {
+        throw std::runtime_error(
+            "Invalid flag name. Flags must start with '-' or '--'");
+      } else if (HasFlag(flag)) {
+        throw std::runtime_error("Flag " + std::string{flag} + " redefined.");
+      }
+      ++num_spec_flags;
+    });
+
+    if (num_spec_flags == 0) {
+      throw std::runtime_error("Optional arguments need at least one flag.");
+    }
+    num_flags += num_spec_flags;
+    num_string_bytes += spec.flags.size() + spec.help.size();
+    num_required += spec.required ? 1 : 0;
+  }
+
+  Touch();
+  // Views into the chunk stay valid, as it never grows past its reserve
+  auto strings = std::make_shared<std::string>();
+  strings->reserve(num_string_bytes);
+  const auto intern = [&strings](std::string_view str) {
+    const std::size_t offset = strings->size();
+    strings->append(str);
+    return std::string_view{*strings}.substr(offset);
+  };
+
+  const std::size_t first_flag = m_table_flags.size();
+  const std::size_t first_optional = m_table_optionals.size();
+  const std::size_t first_required = m_table_required.size();
+  ReserveMore(m_table_flags, num_flags);
+  ReserveMore(m_table_optionals, table.size());
+  ReserveMore(m_table_required, num_required);
+  for (const auto &spec : table) {
+    const std::size_t index = m_table_optionals.size();
+    const auto [nargs, num_args] = SpecNArgs(spec);
+    TableOptional optional{.id = m_num_optionals + (index - first_optional),
+                           .help = intern(spec.help),
+                           .nargs = nargs,
+                           .num_args = num_args,
+                           .required = spec.required,
+                           .action = spec.action,
+                           .first_flag = m_table_flags.size()};
+    for_each_flag(intern(spec.flags), [&](std::string_view flag) {
+      m_table_flags.push_back({flag, index});
+      ++optional.num_flags;
+    });
+    m_table_optionals.push_back(optional);
+    if (spec.required) {
+      m_table_required.push_back(index);
+    }
+  }
+
+  if (const auto duplicate = IndexTableFlags(first_flag)) {
+    const std::string message =
+        "Flag " + std::string{*duplicate} + " redefined.";
+    m_table_flags.resize(first_flag);
+    m_table_optionals.resize(first_optional);
+    m_table_required.resize(first_required);
+    static_cast<void>(IndexTableFlags(0));
+    throw std::runtime_error(message);
+  }
+  m_table_strings.push_back(std::move(strings));
+  m_num_optionals += table.size();
+  m_flags_index.reset();
+
+  for (std::size_t i = 0; i < table.size(); ++i) {
+    const auto &spec = table[i];
+    if (!spec.default_value.has_value()) {
+      continue;
+    }
+    const auto value = std::make_shared<const DefaultValue>(
+        std::string{*spec.default_value});
+    const TableOptional &optional = m_table_optionals[first_optional + i];
+    Defaults &defaults = MutableDefaults();
+    for (std::size_t flag = 0; flag < optional.num_flags; ++flag) {
+      defaults.arguments.insert_or_assign(
+          std::string{m_table_flags[optional.first_flag + flag].flag},
+          Argument{value});
+    }
+  }
+}
+
+std::optional<std::string_view>
+detail::ParserCore::IndexTableFlags(std::size_t first) {
+  const std::size_t num_flags = m_table_flags.size();
+  if ((first == 0) || (2 * num_flags > m_table_index.size())) {
+    m_table_index.assign(std::bit_ceil(std::max<std::size_t>(2 * num_flags, 8)),
+                         0);
+    first = 0;
+  }
+
+  const std::size_t mask = m_table_index.size() - 1;
+  for (std::size_t i = first; i < num_flags; ++i) {
+    const std::string_view flag = m_table_flags[i].flag;
+    std::size_t bucket = Fnv1a(flag) & mask;
+    while (m_table_index[bucket] != 0) {
+      if (m_table_flags[m_table_index[bucket] - 1].flag == flag) {
+        return flag;
+      }
+      bucket = (bucket + 1) & mask;
+    }
+    m_table_index[bucket] = i + 1;
+  }
+  return std::nullopt;
+}
+
+std::optional<std::size_t>
+detail::ParserCore::FindTableFlag(std::string_view flag) const {
+  if (m_table_index.empty()) {
+    return std::nullopt;
+  }
+
+  const std::size_t mask = m_table_index.size() - 1;
+  std::size_t bucket = Fnv1a(flag) & mask;
+  while (m_table_index[bucket] != 0) {
+    ARGPARSE_COUNT_OPERATION();
+    const std::size_t index = m_table_index[bucket] - 1;
+    if (m_table_flags[index].flag == flag) {
+      return index;
+    }
+    bucket = (bucket + 1) & mask;
+  }
+  return std::nullopt;
+}
+
+detail::OptionalRef detail::ParserCore::TableRef(std::size_t index) const {
+  const TableOptional &optional = m_table_optionals[index];
+
+  detail::OptionalRef ref;
+  ref.id = optional.id;
+  ref.nargs = optional.nargs;
+  ref.num_args = optional.num_args;
+  ref.required = optional.required;
+  ref.action = optional.action;
+  ref.help = optional.help;
+  ref.num_flags = optional.num_flags;
+  ref.table_flags = &m_table_flags[optional.first_flag];
+  return ref;
+}
+
+std::vector<std::byte> detail::ParserCore::Serialize() const {
+  SchemaWriter writer;
+  writer.SetDescription(m_program_description);
+  writer.SetIgnoreFirstArgument(m_ignore_first_argument);
+
+  for (const auto &positional : m_positional_order) {
+    writer.AddPositional(positional.Name(), positional.Help(),
+                         positional.GetNArgs());
+  }
+
+  ForEachOptional([&writer](const detail::OptionalRef &optional) {
+    writer.AddOptional(optional.help, {optional.nargs, optional.num_args},
+                       optional.required, optional.action);
+    for (std::size_t i = 0; i < optional.num_flags; ++i) {
+      writer.AddFlag(optional.Flag(i));
+    }
+  });
+
+  return writer.Finish();
+}
+
+const ArgumentMap detail::ParserCore::Parse(int argc, const char *argv[]) {
+  const auto args = env::GetArgs(argc, argv);
+  return Parse(args);
+}
+
+const ArgumentMap detail::ParserCore::Parse(std::span<const char *> args) {
+  ArgumentMap map;
+  ParseInto(args, map);
+  return map;
+}
+
+const ArgumentMap detail::ParserCore::Parse(std::span<const std::string> args) {
+  ArgumentMap map;
+  ParseInto(args, map);
+  return map;
+}
+
+const ArgumentMap detail::ParserCore::Parse(std::string_view line) {
+  ArgumentMap map;
+  ParseInto(line, map);
+  return map;
+}
+
+void detail::ParserCore::ParseInto(int argc, const char *argv[],
+                                   ArgumentMap &map) {
+  const auto args = env::GetArgs(argc, argv);
+  ParseInto(args, map);
+}
+
+void detail::ParserCore::ParseInto(std::span<const char *> args,
+                                   ArgumentMap &map) {
+  map.Clear();
+  map.m_defaults = m_defaults;
+  ParseArgs(GetTokens(args), &map);
+}
+
+void detail::ParserCore::ParseInto(std::span<const std::string> args,
+                                   ArgumentMap &map) {
+  map.Clear();
+  map.m_defaults = m_defaults;
+  ParseArgs(GetTokens(args), &map);
+}
+
+void detail::ParserCore::ParseInto(std::string_view line, ArgumentMap &map) {
+  map.Clear();
+  map.m_defaults = m_defaults;
+  ParseArgs(SplitCommandLine(line), &map);
+}
+
+const ArgumentMap detail::ParserCore::ParseLazy(int argc, const char *argv[]) {
+  const auto args = env::GetArgs(argc, argv);
+  return ParseLazy(args);
+}
+
+const ArgumentMap detail::ParserCore::ParseLazy(std::span<const char *> args) {
+  return MakeLazy(GetTokens(args));
+}
+
+const ArgumentMap
+detail::ParserCore::ParseLazy(std::span<const std::string> args) {
+  return MakeLazy(GetTokens(args));
+}
+
+const ArgumentMap detail::ParserCore::ParseLazy(std::string_view line) {
+  return MakeLazy(SplitCommandLine(line));
+}
+
+ArgumentMap
+detail::ParserCore::MakeLazy(std::span<const std::string_view> tokens) const {
+  auto state = std::make_shared<ArgumentMap::LazyState>();
+  {
+    const std::lock_guard lock(m_lazy_mutex);
+    state->definitions = m_lazy_definitions.lock();
+    if (state->definitions == nullptr) {
+      state->definitions = std::make_shared<LazyDefinitions>();
+      state->definitions->parser = shared_from_this();
+      m_lazy_definitions = state->definitions;
+    }
+  }
+
+  std::size_t num_bytes = 0;
+  for (const auto &token : tokens) {
+    num_bytes += token.size();
+  }
+  state->storage.reserve(num_bytes);
+  for (const auto &token : tokens) {
+    state->storage.append(token);
+  }
+
+  // Views are taken once the storage is complete
+  const std::string_view storage = state->storage;
+  state->tokens.reserve(tokens.size());
+  std::size_t offset = 0;
+  for (const auto &token : tokens) {
+    state->tokens.push_back(storage.substr(offset, token.size()));
+    offset += token.size();
+  }
+
+  // The only scan of the tokens until arguments are read
+  const std::size_t num_tokens = tokens.size();
+  state->first = std::min<std::size_t>(m_ignore_first_argument ? 1 : 0,
+                                       num_tokens);
+  state->option_starts.reserve(num_tokens - state->first);
+  for (std::size_t i = state->first; i < num_tokens; ++i) {
+    if (IsOption(state->tokens[i])) {
+      state->option_starts.push_back(i);
+    }
+  }
+  state->num_positionals =
+      (state->option_starts.empty() ? num_tokens
+                                    : state->option_starts.front()) -
+      state->first;
+
+  // The environment is read now, as in an eager parse, through the same
+  // scan. Entries are kept by name, as the definitions may be copied.
+  const auto env_values = ScanEnvironment();
+  const auto entry_size = [](const EnvValue &env_value) {
+    return env_value.variable.size() + 1 + env_value.value.size();
+  };
+  std::size_t env_bytes = 0;
+  for (const auto &env_value : env_values) {
+    env_bytes += entry_size(env_value);
+  }
+  state->env_storage.reserve(env_bytes);
+  for (const auto &env_value : env_values) {
+    state->env_storage.append(env_value.variable);
+    state->env_storage.push_back('=');
+    state->env_storage.append(env_value.value);
+  }
+  const std::string_view env_storage = state->env_storage;
+  state->env_entries.reserve(env_values.size());
+  offset = 0;
+  for (const auto &env_value : env_values) {
+    state->env_entries.push_back(
+        env_storage.substr(offset, entry_size(env_value)));
+    offset += entry_size(env_value);
+  }
+
+  state->resolved.m_defaults = m_defaults;
+  ArgumentMap map;
+  map.m_defaults = m_defaults;
+  map.m_lazy = std::move(state);
+  return map;
+}
+
+const Argument *detail::ParserCore::ResolveLazy(ArgumentMap::LazyState &state,
+                                                std::string_view name,
+                                                bool with_defaults) const {
+  const std::lock_guard<std::mutex> lock(state.mutex);
+  if (!state.validated) {
+    if (HasPositional(name)) {
+      if (!state.positionals_resolved) {
+        const auto positionals = std::span{state.tokens}.subspan(
+            state.first, state.num_positionals);
+        ParsePositionals(positionals, &state.resolved, nullptr);
+        state.positionals_resolved = true;
+      }
+    } else if (const auto optional = FindOptional(name)) {
+      if (!state.resolved_ids.contains(optional->id)) {
+        try {
+          ResolveLazyOptional(state, *optional);
+        } catch (...) {
+          // Drop what was stored, so the next access fails the same way
+          for (std::size_t i = 0; i < optional->num_flags; ++i) {
+            const auto it = state.resolved.m_map.find(optional->Flag(i));
+            if (it != state.resolved.m_map.end()) {
+              state.resolved.m_map.erase(it);
+            }
+          }
+          throw;
+        }
+        state.resolved_ids.insert(optional->id);
+      }
+    }
+  }
+
+  return state.resolved.Find(name, with_defaults);
+}
+
+void detail::ParserCore::ResolveLazyOptional(
+    ArgumentMap::LazyState &state, const detail::OptionalRef &optional) const {
+  const auto tokens = std::span{state.tokens};
+  const auto &starts = state.option_starts;
+  std::size_t occurrence = 0;
+  for (std::size_t i = 0; i < starts.size(); ++i) {
+    const std::string_view token = tokens[starts[i]];
+    bool matches = false;
+    for (std::size_t flag = 0; flag < optional.num_flags; ++flag) {
+      matches = matches || (optional.Flag(flag) == token);
+    }
+    if (!matches) {
+      continue;
+    }
+
+    const std::size_t end =
+        ((i + 1) < starts.size()) ? starts[i + 1] : tokens.size();
+    const auto values = tokens.subspan(starts[i] + 1, end - starts[i] - 1);
+    StoreOptional(optional, token, values, &state.resolved, nullptr,
+                  occurrence);
+  }
+
+  if ((occurrence == 0) && (optional.optional != nullptr) &&
+      !optional.optional->env.empty()) {
+    const EnvIndex &index = GetEnvIndex();
+    for (const auto &entry : state.env_entries) {
+      const auto env_value = MatchEnvEntry(index, entry);
+      if (env_value.has_value() && (env_value->optional == optional.optional)) {
+        ApplyEnvValue(*env_value, &state.resolved, nullptr, occurrence);
+      }
     }
   }
+}
+
+void detail::ParserCore::ValidateLazy(ArgumentMap::LazyState &state) const {
+  const std::lock_guard<std::mutex> lock(state.mutex);
+  if (state.validated) {
+    return;
+  }
+
+  ArgumentMap full;
+  full.m_defaults = m_defaults;
+  ParseArgs(state.tokens, ScanEnvironment(state.env_entries), &full, false);
+  // Only add what was not resolved yet: arguments already read may be
+  // referenced, so their nodes must stay in place
+  for (auto &[name, entry] : full.m_map) {
+    state.resolved.m_map.try_emplace(name, std::move(entry));
+  }
+  state.validated = true;
+}
+
+ArgumentSnapshot detail::ParserCore::ParseSnapshot(int argc,
+                                                   const char *argv[]) {
+  const auto args = env::GetArgs(argc, argv);
+  return ParseSnapshot(args);
+}
+
+ArgumentSnapshot
+detail::ParserCore::ParseSnapshot(std::span<const char *> args) {
+  return ParseCached(args);
+}
+
+ArgumentSnapshot
+detail::ParserCore::ParseSnapshot(std::span<const std::string> args) {
+  return ParseCached(args);
+}
+
+ArgumentSnapshot detail::ParserCore::ParseSnapshot(std::string_view line) {
+  return ParseCached(line);
+}
+
+// Keys of the parse cache. Tokens are prefixed by their size and a line by a
+// tag, so different inputs never share a key.
+static void AppendSized(std::string &key, std::string_view value) {
+  const std::size_t size = value.size();
+  key.append(reinterpret_cast<const char *>(&size), sizeof(size));
+  key.append(value);
+}
+
+template <typename T>
+static void AppendCacheKey(std::string &key, std::span<T> args) {
+  key.push_back('T');
+  for (const std::string_view arg : args) {
+    AppendSized(key, arg);
+  }
+}
+
+static void AppendCacheKey(std::string &key, std::string_view line) {
+  key.push_back('L');
+  key.append(line);
+}
+
+template <typename Input>
+ArgumentSnapshot detail::ParserCore::ParseCached(Input input) {
+  bool cache_enabled = false;
+  {
+    const std::lock_guard lock(m_cache_mutex);
+    cache_enabled = (m_cache_capacity != 0);
+  }
+  if (!cache_enabled) {
+    auto map = std::make_shared<ArgumentMap>();
+    ParseInto(input, *map);
+    return map;
+  }
+
+  // The environment variables read by the parser are part of the key
+  const auto env_values = ScanEnvironment();
+  static thread_local ScratchBuffer<std::string> key_buffer;
+  auto &key = key_buffer.Get();
+  key.clear();
+  for (const auto &env_value : env_values) {
+    key.push_back('E');
+    AppendSized(key, env_value.variable);
+    AppendSized(key, env_value.value);
+  }
+  AppendCacheKey(key, input);
+
+  if (auto snapshot = FindCached(key)) {
+    return snapshot;
+  }
+
+  auto map = std::make_shared<ArgumentMap>();
+  map->m_defaults = m_defaults;
+  if constexpr (std::is_same_v<Input, std::string_view>) {
+    ParseArgs(SplitCommandLine(input), env_values, map.get());
+  } else {
+    ParseArgs(GetTokens(input), env_values, map.get());
+  }
+  StoreCached(key, map);
+  return map;
+}
+
+void detail::ParserCore::EnableParseCache(std::size_t capacity) {
+  const std::lock_guard lock(m_cache_mutex);
+  m_cache_capacity = capacity;
+  m_cache_index.clear();
+  m_cache.clear();
+}
+
+ParseCacheStats detail::ParserCore::GetParseCacheStats() const {
+  const std::lock_guard lock(m_cache_mutex);
+  return m_cache_stats;
+}
+
+ArgumentSnapshot detail::ParserCore::FindCached(std::string_view key) {
+  const std::lock_guard lock(m_cache_mutex);
+  if (m_cache_generation != m_generation) {
+    m_cache_index.clear();
+    m_cache.clear();
+    m_cache_generation = m_generation;
+  }
+
+  const auto it = m_cache_index.find(key);
+  if (it == m_cache_index.end()) {
+    ++m_cache_stats.misses;
+    return nullptr;
+  }
 
-  return optional;
+  ++m_cache_stats.hits;
+  m_cache.splice(m_cache.begin(), m_cache, it->second);
+  return it->second->snapshot;
 }
 
-Optional &ArgumentParser::AddOptional(const std::string &flag) {
-  return AddOptional(std::initializer_list<std::string>{flag});
+void detail::ParserCore::StoreCached(std::string_view key,
+                                     const ArgumentSnapshot &snapshot) {
+  const std::lock_guard lock(m_cache_mutex);
+  if ((m_cache_capacity == 0) || m_cache_index.contains(key)) {
+    return;
+  }
+
+  m_cache.push_front({std::string{key}, snapshot});
+  m_cache_index.emplace(m_cache.front().key, m_cache.begin());
+  if (m_cache.size() > m_cache_capacity) {
+    m_cache_index.erase(m_cache.back().key);
+    m_cache.pop_back();
+  }
 }
 
-const ArgumentMap ArgumentParser::Parse(int argc, const char *argv[]) {
+void detail::ParserCore::ParseAndBind(int argc, const char *argv[]) {
   const auto args = env::GetArgs(argc, argv);
-  return Parse(args);
+  ParseAndBind(args);
 }
 
-const ArgumentMap ArgumentParser::Parse(std::span<const char *> args) {
-  std::vector<std::string> str_args;
-  std::copy(args.begin(), args.end(), std::back_inserter(str_args));
-  return Parse(str_args);
+void detail::ParserCore::ParseAndBind(std::span<const char *> args) {
+  ParseArgs(GetTokens(args), nullptr);
+}
+
+void detail::ParserCore::ParseAndBind(std::span<const std::string> args) {
+  ParseArgs(GetTokens(args), nullptr);
+}
+
+void detail::ParserCore::ParseAndBind(std::string_view line) {
+  ParseArgs(SplitCommandLine(line), nullptr);
+}
+
+void detail::ParserCore::ParseArgs(std::span<const std::string_view> args,
+                                   ArgumentMap *map) const {
+  ParseArgs(args, ScanEnvironment(), map);
 }
 
-const ArgumentMap ArgumentParser::Parse(std::span<const std::string> in_args) {
+void detail::ParserCore::ParseArgs(std::span<const std::string_view> in_args,
+                                   std::span<const EnvValue> env_values,
+                                   ArgumentMap *map, bool bind) const {
   const std::size_t first_argument = m_ignore_first_argument ? 1 : 0;
   const auto args = in_args.subspan(first_argument);
 
   const std::size_t args_size = args.size();
   std::size_t num_positionals = 0;
   for (std::size_t i = 0; i < args_size; ++i) {
+    ARGPARSE_COUNT_OPERATION();
     if (IsOption(args[i])) {
       break;
     }
     ++num_positionals;
   }
 
-  const std::span<const std::string> positionals =
+  const std::span<const std::string_view> positionals =
       args.subspan(0, num_positionals);
-  const std::span<const std::string> optionals = args.subspan(num_positionals);
+  const std::span<const std::string_view> optionals =
+      args.subspan(num_positionals);
 
-  ValidateRequiredOptionals(optionals);
+  ValidateRequiredOptionals(optionals, env_values);
 
-  ArgumentMap map;
-  ParsePositionals(positionals, map);
-  ParseOptionals(optionals, map);
+  static thread_local ScratchBuffer<Bindings> buffer;
+  Bindings *bindings = bind ? &buffer.Get() : nullptr;
+  if (bindings != nullptr) {
+    bindings->Clear();
+  }
+  ParsePositionals(positionals, map, bindings);
+  ParseOptionals(optionals, env_values, map, bindings);
+  if (bindings != nullptr) {
+    bindings->Apply();
+  }
+}
 
-  return map;
+static bool IsPresent(std::span<const std::uint64_t> present,
+                      std::size_t id) {
+  return ((present[id / 64] >> (id % 64)) & 1) != 0;
 }
 
-void ArgumentParser::ValidateRequiredOptionals(
-    std::span<const std::string> args) const {
-  for (const auto &optional : m_optionals) {
-    if (optional.required == false) {
-      continue;
+static void CheckRequiredOptional(const detail::OptionalRef &optional,
+                                  std::span<const std::uint64_t> present) {
+  if (IsPresent(present, optional.id)) {
+    return;
+  }
+
+  std::stringstream ss;
+  ss << "Option ";
+  if (optional.num_flags == 1) {
+    ss << optional.Flag(0);
+  } else {
+    ss << "{";
+    for (std::size_t i = 0; i < (optional.num_flags - 1); ++i) {
+      ss << optional.Flag(i) << ", ";
     }
+    ss << optional.Flag(optional.num_flags - 1) << "}";
+  }
+  ss << " is required.";
 
-    bool found_required = false;
-    for (const auto &flag : optional.flags) {
-      const auto it = std::find(args.begin(), args.end(), flag);
-      if (it != args.end()) {
-        found_required = true;
-        break;
+  throw std::runtime_error(ss.str());
+}
+
+void detail::ParserCore::CheckConstraint(
+    const Constraint &constraint,
+    std::span<const std::uint64_t> present) const {
+  using Kind = Constraint::Kind;
+  if ((constraint.kind == Kind::DEPENDENCY) &&
+      !IsPresent(present, constraint.trigger)) {
+    return;
+  }
+
+  std::size_t num_present = 0;
+  bool all_present = true;
+  for (std::size_t i = 0; i < constraint.num_words; ++i) {
+    ARGPARSE_COUNT_OPERATION();
+    const std::uint64_t mask = m_constraint_masks[constraint.mask + i];
+    const std::uint64_t bits = present[constraint.first_word + i] & mask;
+    num_present += static_cast<std::size_t>(std::popcount(bits));
+    all_present = all_present && (bits == mask);
+  }
+
+  const auto join = [](std::span<const std::string> flags) {
+    std::string joined;
+    for (const auto &flag : flags) {
+      joined += (joined.empty() ? "" : ", ") + flag;
+    }
+    return joined;
+  };
+
+  switch (constraint.kind) {
+  case Kind::EXCLUSIVE:
+  case Kind::REQUIRED_EXCLUSIVE:
+    if (num_present > 1) {
+      throw std::runtime_error("Options " + join(constraint.flags) +
+                               " are mutually exclusive.");
+    }
+    if ((num_present == 0) && (constraint.kind == Kind::REQUIRED_EXCLUSIVE)) {
+      throw std::runtime_error("One of the options " + join(constraint.flags) +
+                               " is required.");
+    }
+    break;
+
+  case Kind::DEPENDENCY:
+    if (!all_present) {
+      const auto dependencies = std::span{constraint.flags}.subspan(1);
+      throw std::runtime_error("Option " + constraint.flags.front() +
+                               " requires " + join(dependencies) + ".");
+    }
+    break;
+  }
+}
+
+const detail::ParserCore::EnvIndex &detail::ParserCore::GetEnvIndex() const {
+  if (m_env_index_generation.load(std::memory_order_acquire) !=
+      m_generation) {
+    const std::lock_guard<std::mutex> lock(m_env_index_mutex);
+    if (m_env_index_generation.load(std::memory_order_relaxed) !=
+        m_generation) {
+      m_env_index.clear();
+      ForEachLayer([this](const ParserCore &layer) {
+        for (const auto &optional : layer.m_optionals) {
+          if (!optional.env.empty()) {
+            m_env_index.emplace(optional.env, &optional);
+          }
+        }
+      });
+      m_env_index_generation.store(m_generation, std::memory_order_release);
+    }
+  }
+  return m_env_index;
+}
+
+std::optional<detail::ParserCore::EnvValue>
+detail::ParserCore::MatchEnvEntry(const EnvIndex &index,
+                                  std::string_view entry) {
+  const std::size_t equals = entry.find('=');
+  if (equals == std::string_view::npos) {
+    return std::nullopt;
+  }
+
+  const auto it = index.find(entry.substr(0, equals));
+  if (it == index.end()) {
+    return std::nullopt;
+  }
+  return EnvValue{it->second, it->first, entry.substr(equals + 1)};
+}
+
+std::span<const detail::ParserCore::EnvValue>
+detail::ParserCore::ScanEnvironment() const {
+  const EnvIndex &index = GetEnvIndex();
+  static thread_local ScratchBuffer<std::vector<EnvValue>> buffer;
+  auto &env_values = buffer.Get();
+  env_values.clear();
+  char **environment = Environment();
+  if (index.empty() || (environment == nullptr)) {
+    return env_values;
+  }
+
+  for (char **entry = environment; *entry != nullptr; ++entry) {
+    if (const auto env_value = MatchEnvEntry(index, *entry)) {
+      env_values.push_back(*env_value);
+    }
+  }
+  return env_values;
+}
+
+std::span<const detail::ParserCore::EnvValue>
+detail::ParserCore::ScanEnvironment(
+    std::span<const std::string_view> entries) const {
+  const EnvIndex &index = GetEnvIndex();
+  static thread_local ScratchBuffer<std::vector<EnvValue>> buffer;
+  auto &env_values = buffer.Get();
+  env_values.clear();
+  for (const auto &entry : entries) {
+    if (const auto env_value = MatchEnvEntry(index, entry)) {
+      env_values.push_back(*env_value);
+    }
+  }
+  return env_values;
+}
+
+// A zero count or a false switch in the environment stores nothing
+static bool EnvValueStores(const Optional &optional, std::string_view value) {
+  if (optional.action == Action::COUNT) {
+    return NumberFromString<std::size_t>(value) != 0;
+  }
+  if ((optional.nargs == NArgs::NUMERIC) && (optional.num_args == 0)) {
+    return FromString<bool>(value);
+  }
+  return true;
+}
+
+void detail::ParserCore::ValidateRequiredOptionals(
+    std::span<const std::string_view> args,
+    std::span<const EnvValue> env_values) const {
+  // Optionals given in this parse, as a bitset over their ids. Only the
+  // words set here are cleared afterwards, so the cost follows the given
+  // options rather than the defined ones.
+  static thread_local std::vector<std::uint64_t> present;
+  static thread_local std::vector<std::size_t> present_words;
+  struct ClearPresent {
+    ~ClearPresent() {
+      for (const std::size_t word : present_words) {
+        present[word] = 0;
       }
+      present_words.clear();
     }
+  } clear_present;
+  present.resize(std::max(present.size(), (m_num_optionals + 63) / 64), 0);
+  const auto set_present = [](std::size_t id) {
+    present_words.push_back(id / 64);
+    present[id / 64] |= std::uint64_t{1} << (id % 64);
+  };
 
-    if (found_required) {
+  for (const auto &arg : args) {
+    ARGPARSE_COUNT_OPERATION();
+    if (!IsOption(arg)) {
       continue;
     }
+    const auto optional = FindOptional(arg);
+    if (optional.has_value()) {
+      set_present(optional->id);
+    }
+  }
+  for (const auto &env_value : env_values) {
+    if (EnvValueStores(*env_value.optional, env_value.value)) {
+      set_present(env_value.optional->id);
+    }
+  }
 
-    std::stringstream ss;
-    ss << "Option ";
-    if (optional.flags.size() == 1) {
-      ss << optional.flags[0];
-    } else {
-      ss << "{";
-      const std::size_t num_flags = optional.flags.size();
-      for (std::size_t i = 0; i < (num_flags - 1); ++i) {
-        ss << optional.flags[i] << ", ";
+  ForEachLayer([](const ParserCore &layer) {
+    for (const Optional *optional : layer.m_required_optionals) {
+      ARGPARSE_COUNT_OPERATION();
+      CheckRequiredOptional(MakeRef(*optional), present);
+    }
+
+    for (const std::size_t index : layer.m_table_required) {
+      ARGPARSE_COUNT_OPERATION();
+      CheckRequiredOptional(layer.TableRef(index), present);
+    }
+
+    for (const auto &attached : layer.m_schemas) {
+      const std::size_t num_required = attached.schema.NumRequired();
+      for (std::size_t i = 0; i < num_required; ++i) {
+        ARGPARSE_COUNT_OPERATION();
+        const std::size_t index = attached.schema.GetRequired(i);
+        CheckRequiredOptional(
+            MakeRef(attached.schema, index, attached.first_id), present);
       }
-      ss << optional.flags.back() << "}";
     }
-    ss << " is required.";
 
-    throw std::runtime_error(ss.str());
-  }
+    for (const auto &constraint : layer.m_constraints) {
+      layer.CheckConstraint(constraint, present);
+    }
+  });
 }
 
-std::size_t ArgumentParser::GetMinNumberOfArguments(
-    std::list<Positional>::const_iterator begin,
-    std::list<Positional>::const_iterator end) const {
-  std::size_t count = 0;
-  for (auto it = begin; it != end; ++it) {
-    const auto [nargs, num_args] = it->GetNArgs();
-    switch (nargs) {
-    case NArgs::NUMERIC:
-      count += num_args;
-      break;
+static std::size_t GetMinNumberOfArguments(NArgs nargs, std::size_t num_args) {
+  switch (nargs) {
+  case NArgs::NUMERIC:
+    return num_args;
 
-    case NArgs::OPTIONAL:
-    case NArgs::ZERO_OR_MORE:
-      break;
+  case NArgs::OPTIONAL:
+  case NArgs::ZERO_OR_MORE:
+    return 0;
 
-    case NArgs::ONE_OR_MORE:
-      ++count;
-      break;
-    }
+  case NArgs::ONE_OR_MORE:
+    return 1;
   }
 
-  return count;
+  return 0;
 }
 
-void ArgumentParser::ParsePositionals(std::span<const std::string> args,
-                                      ArgumentMap &map) const {
+void detail::ParserCore::ParsePositionals(
+    std::span<const std::string_view> args, ArgumentMap *map,
+    Bindings *bindings) const {
   const std::size_t num_args = args.size();
   std::size_t current_arg_index = 0;
 
-  for (auto pos_it = m_positionals.begin(); pos_it != m_positionals.end();
-       ++pos_it) {
-    const auto [pos_nargs, pos_num_args] = pos_it->GetNArgs();
-    const std::size_t min_num_other_positionals =
-        GetMinNumberOfArguments(std::next(pos_it), m_positionals.end());
+  // Minimum number of values taken by the positionals after each one, as
+  // suffix sums so that matching stays linear in the positionals
+  const std::size_t num_positionals = m_positional_order.size();
+  static thread_local ScratchBuffer<std::vector<std::size_t>> buffer;
+  auto &min_following = buffer.Get();
+  min_following.assign(num_positionals, 0);
+  for (std::size_t i = num_positionals; i > 1; --i) {
+    ARGPARSE_COUNT_OPERATION();
+    const auto [nargs, num_nargs] = m_positional_order[i - 1].GetNArgs();
+    min_following[i - 2] =
+        min_following[i - 1] + GetMinNumberOfArguments(nargs, num_nargs);
+  }
+
+  for (std::size_t i = 0; i < num_positionals; ++i) {
+    ARGPARSE_COUNT_OPERATION();
+    const detail::PositionalRef &positional = m_positional_order[i];
+    const auto [pos_nargs, pos_num_args] = positional.GetNArgs();
+    const std::size_t min_num_other_positionals = min_following[i];
     const std::size_t num_remaining_args =
         num_args - current_arg_index - min_num_other_positionals;
-    const auto &name = pos_it->name;
+    const std::string_view name = positional.Name();
 
     std::size_t num_matched_args = 0;
     switch (pos_nargs) {
     case NArgs::NUMERIC: {
       if (num_remaining_args < pos_num_args) {
-        throw std::runtime_error("Positional argument " + name + " requires " +
-                                 std::to_string(pos_num_args) +
+        throw std::runtime_error("Positional argument " + std::string{name} +
+                                 " requires " + std::to_string(pos_num_args) +
                                  " values but found " +
                                  std::to_string(num_remaining_args) + ".");
       }
@@ -459,7 +3593,7 @@ void ArgumentParser::ParsePositionals(std::span<const std::string> args,
     case NArgs::ONE_OR_MORE: {
       if (num_remaining_args < 1) {
         throw std::runtime_error(
-            "Positional argument " + name +
+            "Positional argument " + std::string{name} +
             " requires one or more values but found none.");
       }
       num_matched_args = num_remaining_args;
@@ -478,7 +3612,17 @@ void ArgumentParser::ParsePositionals(std::span<const std::string> args,
     }
     const auto subspan = args.subspan(current_arg_index, num_matched_args);
     current_arg_index += num_matched_args;
-    map.Add(name, subspan);
+
+    const Binder *binder = positional.GetBinder();
+    if ((bindings != nullptr) && (binder != nullptr)) {
+      bindings->Add(*binder, subspan, false);
+    }
+    // Leave out positionals not given, so reads fall back to the default
+    const bool use_default =
+        subspan.empty() && (m_defaults->Find(name) != nullptr);
+    if ((map != nullptr) && !use_default) {
+      map->Add(name, subspan);
+    }
   }
 
   if (current_arg_index < num_args) {
@@ -486,61 +3630,131 @@ void ArgumentParser::ParsePositionals(std::span<const std::string> args,
   }
 }
 
-void ArgumentParser::ParseOptionals(std::span<const std::string> args,
-                                    ArgumentMap &map) const {
+void detail::ParserCore::ParseOptionals(std::span<const std::string_view> args,
+                                        std::span<const EnvValue> env_values,
+                                        ArgumentMap *map,
+                                        Bindings *bindings) const {
+  // Occurrences of each optional in this parse, indexed by id
+  static thread_local ScratchBuffer<std::vector<std::size_t>> buffer;
+  auto &occurrences = buffer.Get();
+  occurrences.assign(m_num_optionals, 0);
+
   std::size_t current_index = 0;
   const std::size_t args_size = args.size();
   while (current_index < args_size) {
     const auto subspan = args.subspan(current_index);
-    current_index += TryMatchOptional(subspan, map);
+    current_index += TryMatchOptional(subspan, map, bindings, occurrences);
+  }
+
+  // The command line takes precedence over the environment
+  for (const auto &env_value : env_values) {
+    if (occurrences[env_value.optional->id] == 0) {
+      ApplyEnvValue(env_value, map, bindings,
+                    occurrences[env_value.optional->id]);
+    }
   }
 }
 
-std::size_t ArgumentParser::TryMatchOptional(std::span<const std::string> args,
-                                             ArgumentMap &map) const {
-  const std::string &token = args[0];
+std::size_t
+detail::ParserCore::TryMatchOptional(std::span<const std::string_view> args,
+                                     ArgumentMap *map, Bindings *bindings,
+                                     std::span<std::size_t> occurrences) const {
+  const std::string_view token = args[0];
+  ARGPARSE_COUNT_OPERATION();
 
   if (!IsOption(token)) {
     return 1;
   }
 
-  const auto optional_it = m_flags_map.find(token);
-  const bool token_not_found = (optional_it == m_flags_map.end());
-  if (token_not_found) {
-    throw std::runtime_error("Undefined option " + std::string{token} + ".");
+  const auto found_optional = FindOptional(token);
+  if (!found_optional.has_value()) {
+    throw std::runtime_error(UndefinedOptionMessage(token));
   }
 
   // Find index of next option
   const std::size_t args_size = args.size();
   std::size_t num_option_values = 0;
   for (std::size_t i = 1; i < args_size; ++i) {
+    ARGPARSE_COUNT_OPERATION();
     if (IsOption(args[i])) {
       break;
     }
     ++num_option_values;
   }
 
-  const Optional &optional = optional_it->second;
-  const std::span<const std::string> option_values =
-      args.subspan(1, num_option_values);
+  StoreOptional(*found_optional, token, args.subspan(1, num_option_values),
+                map, bindings, occurrences[found_optional->id]);
+  return (num_option_values + 1);
+}
+
+void detail::ParserCore::ApplyEnvValue(const EnvValue &env_value,
+                                       ArgumentMap *map, Bindings *bindings,
+                                       std::size_t &occurrence) const {
+  const Optional &optional = *env_value.optional;
+  const std::string_view value = env_value.value;
+  if (!EnvValueStores(optional, value)) {
+    return;
+  }
+
+  if (optional.action == Action::COUNT) {
+    const auto count = NumberFromString<std::size_t>(value);
+    // Stored as the last of count occurrences
+    occurrence = count - 1;
+    StoreOptional(MakeRef(optional), env_value.variable, {}, map, bindings,
+                  occurrence);
+    return;
+  }
+
+  if ((optional.nargs == NArgs::NUMERIC) && (optional.num_args == 0)) {
+    StoreOptional(MakeRef(optional), env_value.variable, {}, map, bindings,
+                  occurrence);
+    return;
+  }
+
+  if ((optional.nargs == NArgs::NUMERIC) && (optional.num_args == 1)) {
+    StoreOptional(MakeRef(optional), env_value.variable, {&value, 1}, map,
+                  bindings, occurrence);
+    return;
+  }
+
+  static thread_local ScratchBuffer<std::vector<std::string_view>> buffer;
+  auto &values = buffer.Get();
+  values.clear();
+  std::size_t pos = 0;
+  while ((pos = value.find_first_not_of(' ', pos)) != std::string_view::npos) {
+    const std::size_t end = std::min(value.find(' ', pos), value.size());
+    values.push_back(value.substr(pos, end - pos));
+    pos = end;
+  }
+  StoreOptional(MakeRef(optional), env_value.variable, values, map, bindings,
+                occurrence);
+}
+
+void detail::ParserCore::StoreOptional(const detail::OptionalRef &optional,
+                                       std::string_view source,
+                                       std::span<const std::string_view> values,
+                                       ArgumentMap *map, Bindings *bindings,
+                                       std::size_t &occurrence) const {
+  const std::size_t num_values = values.size();
+
   switch (optional.nargs) {
   // N
   case NArgs::NUMERIC: {
-    if (num_option_values != optional.num_args) {
-      throw std::runtime_error("Option " + std::string{token} + " expected " +
+    if (num_values != optional.num_args) {
+      throw std::runtime_error("Option " + std::string{source} + " expected " +
                                std::to_string(optional.num_args) +
                                " arguments but found " +
-                               std::to_string(num_option_values) + ".");
+                               std::to_string(num_values) + ".");
     }
     break;
   }
 
   // ?
   case NArgs::OPTIONAL: {
-    if (num_option_values > 1) {
-      throw std::runtime_error("Option " + std::string{token} +
+    if (num_values > 1) {
+      throw std::runtime_error("Option " + std::string{source} +
                                " expected zero or one arguments but found " +
-                               std::to_string(num_option_values) + ".");
+                               std::to_string(num_values) + ".");
     }
     break;
   }
@@ -553,8 +3767,8 @@ std::size_t ArgumentParser::TryMatchOptional(std::span<const std::string> args,
 
   // +
   case NArgs::ONE_OR_MORE: {
-    if (num_option_values < 1) {
-      throw std::runtime_error("Option " + std::string{token} +
+    if (num_values < 1) {
+      throw std::runtime_error("Option " + std::string{source} +
                                " expected one or more arguments but found 0.");
     }
     break;
@@ -563,51 +3777,451 @@ std::size_t ArgumentParser::TryMatchOptional(std::span<const std::string> args,
   default:
     throw std::runtime_error(
         "Unknown number of required optional arguments for " +
-        std::string{token} + ".");
+        std::string{source} + ".");
+  }
+
+  const std::size_t earlier = occurrence++;
+
+  if (optional.action == Action::COUNT) {
+    const std::size_t count = occurrence;
+    if ((bindings != nullptr) && (optional.binder != nullptr)) {
+      bindings->AddCount(*optional.binder, count);
+    }
+    if (map != nullptr) {
+      for (std::size_t i = 0; i < optional.num_flags; ++i) {
+        ARGPARSE_COUNT_OPERATION();
+        map->SetCount(optional.Flag(i), count);
+      }
+    }
+
+    return;
+  }
+
+  const bool accumulate =
+      (earlier > 0) && (optional.action != Action::STORE);
+  if ((bindings != nullptr) && (optional.binder != nullptr)) {
+    bindings->Add(*optional.binder, values, accumulate);
   }
 
   /* TODO: Implement a second map for optional flags to avoid duplicating
    * arguments in the map.
    */
-  for (const auto &flag : optional.flags) {
-    map.Add(flag, option_values);
+  if (map != nullptr) {
+    for (std::size_t i = 0; i < optional.num_flags; ++i) {
+      ARGPARSE_COUNT_OPERATION();
+      if (accumulate) {
+        map->Append(optional.Flag(i), values);
+      } else {
+        map->Add(optional.Flag(i), values);
+      }
+    }
   }
+}
 
-  return (num_option_values + 1);
+std::string
+detail::ParserCore::UndefinedOptionMessage(std::string_view token) const {
+  std::string message = "Undefined option " + std::string{token} + ".";
+
+  std::vector<std::string_view> suggestions;
+  {
+    const std::lock_guard<std::mutex> lock(m_flags_index_mutex);
+    if (m_flags_index == nullptr) {
+      auto index = std::make_unique<detail::BKTree>();
+      ForEachLayer([&index](const ParserCore &layer) {
+        for (const auto &[flag, optional] : layer.m_flags_map) {
+          index->Insert(flag);
+        }
+        for (const auto &table_flag : layer.m_table_flags) {
+          index->Insert(table_flag.flag);
+        }
+        for (const auto &attached : layer.m_schemas) {
+          const std::size_t num_flags = attached.schema.NumFlags();
+          for (std::size_t i = 0; i < num_flags; ++i) {
+            index->Insert(attached.schema.GetFlag(i));
+          }
+        }
+      });
+      m_flags_index = std::move(index);
+    }
+
+    const std::size_t max_distance =
+        std::clamp<std::size_t>(token.size() / 4, 1, 3);
+    suggestions = m_flags_index->FindClosest(token, max_distance, 3);
+  }
+
+  if (!suggestions.empty()) {
+    message += " Did you mean ";
+    for (std::size_t i = 0; i < suggestions.size(); ++i) {
+      if (i > 0) {
+        message += ", ";
+      }
+      message += suggestions[i];
+    }
+    message += "?";
+  }
+
+  return message;
 }
 
-void ArgumentParser::PrintHelp() const {
-  if (!m_program_description.empty()) {
-    std::cout << m_program_description << "\n\n";
+// Width of the terminal, from COLUMNS or the terminal on standard output,
+// or 80 if unknown
+static std::size_t TerminalWidth() {
+  if (const char *columns = std::getenv("COLUMNS")) {
+    const std::string_view str{columns};
+    std::size_t width = 0;
+    const auto result =
+        std::from_chars(str.data(), str.data() + str.size(), width);
+    if ((result.ec == std::errc{}) && (result.ptr == str.data() + str.size()) &&
+        (width > 0)) {
+      return width;
+    }
+  }
+#if defined(ARGPARSE_HAS_IOCTL)
+  struct winsize size;
+  if ((::ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0) && (size.ws_col > 0)) {
+    return size.ws_col;
+  }
+#endif
+  return 80;
+}
+
+// Append text wrapped at spaces to width columns, starting at column and
+// indenting the lines after the first. Newlines in the text are kept.
+static void AppendWrapped(std::string &out, std::string_view text,
+                          std::size_t column, std::size_t indent,
+                          std::size_t width) {
+  bool line_empty = true;
+  std::size_t pos = 0;
+  while (pos < text.size()) {
+    const char c = text[pos];
+    if (c == '\n') {
+      out += '\n';
+      out.append(indent, ' ');
+      column = indent;
+      line_empty = true;
+      ++pos;
+      continue;
+    } else if (c == ' ') {
+      ++pos;
+      continue;
+    }
+
+    const std::size_t end = std::min(text.find_first_of(" \n", pos),
+                                     text.size());
+    const std::size_t word_size = end - pos;
+    if (!line_empty && (column + 1 + word_size > width)) {
+      out += '\n';
+      out.append(indent, ' ');
+      column = indent;
+      line_empty = true;
+    }
+    if (!line_empty) {
+      out += ' ';
+      ++column;
+    }
+    out.append(text.substr(pos, word_size));
+    column += word_size;
+    line_empty = false;
+    pos = end;
   }
+}
 
-  std::cout << "positional arguments:\n";
-  for (const auto &positional : m_positionals) {
-    std::cout << " " + positional.name << " "
-              << PrettyNArgs(positional.GetNArgs()) << "\t" << positional.help
-              << "\n";
+std::string detail::ParserCore::RenderHelp(std::size_t width) const {
+  static constexpr std::size_t INDENT = 2;
+  static constexpr std::size_t GAP = 2;
+
+  // First pass: the widest name that fits in half the width, and the size
+  // of the text
+  const std::size_t max_column = width / 2;
+  std::size_t longest = 0;
+  std::size_t num_bytes = m_program_description.size();
+  std::size_t num_rows = 0;
+  const auto measure = [&](std::size_t left_size, std::string_view help) {
+    if (INDENT + left_size + GAP <= max_column) {
+      longest = std::max(longest, left_size);
+    }
+    num_bytes += left_size + help.size();
+    ++num_rows;
+  };
+  const auto nargs_size = [](const std::string &nargs) {
+    return nargs.empty() ? 0 : nargs.size() + 1;
+  };
+  for (const auto &positional : m_positional_order) {
+    measure(positional.Name().size() +
+                nargs_size(PrettyNArgs(positional.GetNArgs())),
+            positional.Help());
   }
+  ForEachOptional([&](const detail::OptionalRef &optional) {
+    std::size_t left_size = nargs_size(
+        PrettyNArgs({optional.nargs, optional.num_args}));
+    for (std::size_t i = 0; i < optional.num_flags; ++i) {
+      left_size += optional.Flag(i).size() + ((i > 0) ? 2 : 0);
+    }
+    measure(left_size, optional.help);
+  });
+
+  // Help starts at one column for all rows; longer names get a line of
+  // their own
+  const std::size_t column = INDENT + longest + GAP;
+  std::string out;
+  out.reserve(num_bytes + num_rows * (column + INDENT + 1) + 64);
+
+  const auto append_help = [&](std::string_view help) {
+    const std::size_t left_size = out.size() - out.rfind('\n') - 1;
+    if (help.empty()) {
+      out += '\n';
+      return;
+    } else if (left_size + GAP > column) {
+      out += '\n';
+      out.append(column, ' ');
+    } else {
+      out.append(column - left_size, ' ');
+    }
+    AppendWrapped(out, help, column, column, width);
+    out += '\n';
+  };
 
-  std::cout << "\n";
+  if (!m_program_description.empty()) {
+    AppendWrapped(out, m_program_description, 0, 0, width);
+    out += "\n\n";
+  }
 
-  // TODO: Print NArgs
-  std::cout << "optional arguments:\n";
-  for (const auto &optional : m_optionals) {
-    std::cout << " ";
-    std::stringstream ss;
+  out += "positional arguments:\n";
+  for (const auto &positional : m_positional_order) {
+    out.append(INDENT, ' ');
+    out += positional.Name();
+    const std::string nargs = PrettyNArgs(positional.GetNArgs());
+    if (!nargs.empty()) {
+      out += ' ';
+      out += nargs;
+    }
+    append_help(positional.Help());
+  }
 
-    const std::size_t num_flags = optional.flags.size();
-    for (std::size_t i = 0; i < (num_flags - 1); ++i) {
-      ss << optional.flags[i] << ", ";
+  out += "\noptional arguments:\n";
+  ForEachOptional([&](const detail::OptionalRef &optional) {
+    out.append(INDENT, ' ');
+    for (std::size_t i = 0; i < optional.num_flags; ++i) {
+      if (i > 0) {
+        out += ", ";
+      }
+      out += optional.Flag(i);
     }
-    if (num_flags > 0) {
-      ss << optional.flags.back();
+    const std::string nargs = PrettyNArgs({optional.nargs, optional.num_args});
+    if (!nargs.empty()) {
+      out += ' ';
+      out += nargs;
     }
+    append_help(optional.help);
+  });
+
+  return out;
+}
 
-    std::cout << ss.str() << " ";
-    std::cout << PrettyNArgs(optional.GetNArgs());
-    std::cout << " \t" << optional.help << "\n";
+std::shared_ptr<const std::string>
+detail::ParserCore::GetHelp(std::size_t width) const {
+  if (width == 0) {
+    width = TerminalWidth();
   }
+
+  const std::lock_guard lock(m_help_mutex);
+  if ((m_help == nullptr) || (m_help_width != width) ||
+      (m_help_generation != m_generation)) {
+    m_help = std::make_shared<const std::string>(RenderHelp(width));
+    m_help_width = width;
+    m_help_generation = m_generation;
+  }
+  return m_help;
+}
+
+void detail::ParserCore::PrintHelp() const { PrintHelp(std::cout); }
+
+void detail::ParserCore::PrintHelp(std::ostream &out, std::size_t width) const {
+  const auto help = GetHelp(width);
+  out.write(help->data(), static_cast<std::streamsize>(help->size()));
+}
+
+std::size_t detail::ParserCore::FormatHelp(std::span<char> buffer,
+                                           std::size_t width) const {
+  const auto help = GetHelp(width);
+  if (help->size() <= buffer.size()) {
+    std::copy(help->begin(), help->end(), buffer.begin());
+  }
+  return help->size();
+}
+
+ArgumentParser::ArgumentParser()
+    : m_core(std::make_shared<detail::ParserCore>()) {}
+
+ArgumentParser::ArgumentParser(const std::string &description)
+    : m_core(std::make_shared<detail::ParserCore>(description)) {}
+
+ArgumentParser::ArgumentParser(const Schema &schema)
+    : m_core(std::make_shared<detail::ParserCore>(schema)) {}
+
+// Shared by moved-from parsers until their first change copies it
+static const std::shared_ptr<detail::ParserCore> &EmptyCore() {
+  static const auto core = std::make_shared<detail::ParserCore>();
+  return core;
+}
+
+ArgumentParser::ArgumentParser(ArgumentParser &&other) noexcept
+    : m_core(std::exchange(other.m_core, EmptyCore())) {}
+
+ArgumentParser &ArgumentParser::operator=(ArgumentParser &&other) noexcept {
+  if (this != &other) {
+    m_core = std::exchange(other.m_core, EmptyCore());
+  }
+  return *this;
+}
+
+ArgumentParser ArgumentParser::Fork() const {
+  ArgumentParser fork = *this;
+  fork.m_core = detail::ParserCore::Extend(m_core);
+  return fork;
+}
+
+detail::ParserCore &ArgumentParser::Mutable() {
+  if (m_core->IsShared()) {
+    m_core = detail::ParserCore::Extend(std::move(m_core));
+  }
+  return *m_core;
+}
+
+void ArgumentParser::IgnoreFirstArgument(bool ignore) {
+  Mutable().IgnoreFirstArgument(ignore);
+}
+
+Positional &ArgumentParser::AddPositional(const std::string &name) {
+  return Mutable().AddPositional(name);
+}
+
+Optional &
+ArgumentParser::AddOptional(std::initializer_list<std::string> flags) {
+  return Mutable().AddOptional(flags);
+}
+
+Optional &ArgumentParser::AddOptional(const std::string &flag) {
+  return Mutable().AddOptional(flag);
+}
+
+void ArgumentParser::AddOptionals(std::span<const OptionalSpec> table) {
+  Mutable().AddOptionals(table);
+}
+
+void ArgumentParser::AddMutuallyExclusive(
+    std::initializer_list<std::string> flags, bool required) {
+  Mutable().AddMutuallyExclusive(flags, required);
+}
+
+void ArgumentParser::AddDependency(
+    const std::string &flag, std::initializer_list<std::string> dependencies) {
+  Mutable().AddDependency(flag, dependencies);
+}
+
+const ArgumentMap ArgumentParser::Parse(int argc, const char *argv[]) {
+  return m_core->Parse(argc, argv);
+}
+
+const ArgumentMap ArgumentParser::Parse(std::span<const char *> args) {
+  return m_core->Parse(args);
+}
+
+const ArgumentMap ArgumentParser::Parse(std::span<const std::string> args) {
+  return m_core->Parse(args);
+}
+
+const ArgumentMap ArgumentParser::Parse(std::string_view line) {
+  return m_core->Parse(line);
+}
+
+void ArgumentParser::ParseInto(int argc, const char *argv[], ArgumentMap &map) {
+  m_core->ParseInto(argc, argv, map);
+}
+
+void ArgumentParser::ParseInto(std::span<const char *> args, ArgumentMap &map) {
+  m_core->ParseInto(args, map);
+}
+
+void ArgumentParser::ParseInto(std::span<const std::string> args,
+                               ArgumentMap &map) {
+  m_core->ParseInto(args, map);
+}
+
+void ArgumentParser::ParseInto(std::string_view line, ArgumentMap &map) {
+  m_core->ParseInto(line, map);
+}
+
+const ArgumentMap ArgumentParser::ParseLazy(int argc, const char *argv[]) {
+  return m_core->ParseLazy(argc, argv);
+}
+
+const ArgumentMap ArgumentParser::ParseLazy(std::span<const char *> args) {
+  return m_core->ParseLazy(args);
+}
+
+const ArgumentMap ArgumentParser::ParseLazy(std::span<const std::string> args) {
+  return m_core->ParseLazy(args);
+}
+
+const ArgumentMap ArgumentParser::ParseLazy(std::string_view line) {
+  return m_core->ParseLazy(line);
+}
+
+ArgumentSnapshot ArgumentParser::ParseSnapshot(int argc, const char *argv[]) {
+  return m_core->ParseSnapshot(argc, argv);
+}
+
+ArgumentSnapshot ArgumentParser::ParseSnapshot(std::span<const char *> args) {
+  return m_core->ParseSnapshot(args);
+}
+
+ArgumentSnapshot
+ArgumentParser::ParseSnapshot(std::span<const std::string> args) {
+  return m_core->ParseSnapshot(args);
+}
+
+ArgumentSnapshot ArgumentParser::ParseSnapshot(std::string_view line) {
+  return m_core->ParseSnapshot(line);
+}
+
+void ArgumentParser::EnableParseCache(std::size_t capacity) {
+  Mutable().EnableParseCache(capacity);
+}
+
+ParseCacheStats ArgumentParser::GetParseCacheStats() const {
+  return m_core->GetParseCacheStats();
+}
+
+void ArgumentParser::ParseAndBind(int argc, const char *argv[]) {
+  m_core->ParseAndBind(argc, argv);
+}
+
+void ArgumentParser::ParseAndBind(std::span<const char *> args) {
+  m_core->ParseAndBind(args);
+}
+
+void ArgumentParser::ParseAndBind(std::span<const std::string> args) {
+  m_core->ParseAndBind(args);
+}
+
+void ArgumentParser::ParseAndBind(std::string_view line) {
+  m_core->ParseAndBind(line);
+}
+
+std::vector<std::byte> ArgumentParser::Serialize() const {
+  return m_core->Serialize();
+}
+
+void ArgumentParser::PrintHelp() const { m_core->PrintHelp(); }
+
+void ArgumentParser::PrintHelp(std::ostream &out, std::size_t width) const {
+  m_core->PrintHelp(out, width);
+}
+
+std::size_t ArgumentParser::FormatHelp(std::span<char> buffer,
+                                       std::size_t width) const {
+  return m_core->FormatHelp(buffer, width);
 }
 
 } // namespace argparse
@@ -25,10 +25,47 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <numeric>
+#include <ranges>
 #include <span>
+#include <sstream>
+#include <thread>
+
+#if __has_include(<sys/wait.h>)
+#include <sys/wait.h>
+#include <unistd.h>
+#define ARGPARSE_TEST_FORK 1
+#endif
 
 #include "argparse.hpp"
 
+// Atomic, as some tests allocate from several threads
+static std::atomic<std::size_t> g_num_allocations = 0;
+
+void *operator new(std::size_t size) {
+  ++g_num_allocations;
+  if (void *ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+// Not inlined so that GCC does not pair std::free with the new expressions
+// it sees at the call sites (-Wmismatched-new-delete).
+[[gnu::noinline]] static void Deallocate(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr) noexcept { Deallocate(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { Deallocate(ptr); }
+
 TEST(env, GetArgs) {
   int argc = 5;
   const char *argv[5]{
@@ -186,6 +223,85 @@ TEST(Argument, AsDouble) {
               ::testing::ElementsAreArray({3.14, -0.5}));
 }
 
+TEST(Argument, AsRange) {
+  const char *args[] = {"1", "2", "3", "4"};
+  argparse::Argument arg(args);
+
+  const auto range = arg.AsRange<int>();
+  static_assert(std::ranges::random_access_range<decltype(range)>);
+  static_assert(std::ranges::sized_range<decltype(range)>);
+  EXPECT_EQ(std::ranges::size(range), 4);
+  EXPECT_EQ(range[2], 3);
+  EXPECT_EQ(std::accumulate(range.begin(), range.end(), 0), 10);
+
+  auto evens = arg.AsRange<long>() |
+               std::views::filter([](long value) { return value % 2 == 0; });
+  EXPECT_THAT(std::vector<long>(evens.begin(), evens.end()),
+              ::testing::ElementsAreArray({2L, 4L}));
+
+  const char *no_args[] = {"0"};
+  argparse::Argument empty(std::span<const char *>(no_args, 0));
+  EXPECT_TRUE(empty.AsRange<std::string>().empty());
+}
+
+TEST(Argument, small_buffer) {
+  const char *one[] = {"8"};
+  const std::string two[] = {"--level", "info"};
+  const char *many[] = {"0", "1", "2", "3", "4"};
+
+  const std::size_t allocations_before = g_num_allocations;
+  const argparse::Argument arg1(one);
+  const argparse::Argument arg2(two);
+  const argparse::Argument copy(arg2);
+  const std::size_t num_allocations = g_num_allocations - allocations_before;
+  EXPECT_EQ(num_allocations, 0);
+
+  EXPECT_EQ(arg1.Size(), 1);
+  EXPECT_EQ(arg1.As<int>(), 8);
+  EXPECT_THAT(copy.AsVector<std::string>(),
+              ::testing::ElementsAreArray({"--level", "info"}));
+
+  const argparse::Argument arg5(many);
+  EXPECT_EQ(arg5.Size(), 5);
+  EXPECT_THAT(arg5.AsVector<int>(),
+              ::testing::ElementsAreArray({0, 1, 2, 3, 4}));
+}
+
+TEST(Argument, allocations_per_option) {
+  constexpr std::size_t n = 16;
+  argparse::ArgumentParser parser;
+  std::vector<std::string> in_args;
+  for (std::size_t i = 0; i < (2 * n); ++i) {
+    parser.AddOptional("--option" + std::to_string(i));
+    in_args.push_back("--option" + std::to_string(i));
+    in_args.push_back("value");
+  }
+  const auto count_allocations = [&](std::size_t num_options,
+                                     argparse::ArgumentMap *map) {
+    const std::span<const std::string> args{in_args.data(), 2 * num_options};
+    const std::size_t allocations_before = g_num_allocations;
+    if (map == nullptr) {
+      static_cast<void>(parser.Parse(args));
+    } else {
+      parser.ParseInto(args, *map);
+    }
+    return g_num_allocations - allocations_before;
+  };
+  static_cast<void>(count_allocations(2 * n, nullptr)); // Warm up
+
+  // A new map allocates one node per option and grows its buckets, while the
+  // values themselves add nothing
+  const std::size_t fresh_n = count_allocations(n, nullptr);
+  const std::size_t fresh_2n = count_allocations(2 * n, nullptr);
+  EXPECT_LE(fresh_2n - fresh_n, n + 2);
+
+  // A reused map allocates nothing at either size
+  argparse::ArgumentMap map;
+  static_cast<void>(count_allocations(2 * n, &map));
+  EXPECT_EQ(count_allocations(n, &map), 0);
+  EXPECT_EQ(count_allocations(2 * n, &map), 0);
+}
+
 TEST(ArgumentParser, create_parser_with_arguments) {
   argparse::ArgumentParser parser;
   EXPECT_NO_THROW(
@@ -347,3 +463,1570 @@ TEST(ArgumentParser, positionals_and_optionals) {
   EXPECT_TRUE(args.Contains("-b"));
   EXPECT_EQ(args["--required"].As<float>(), 3.14f);
 }
+
+TEST(ArgumentParser, Bind) {
+  struct Config {
+    std::string mode;
+    std::vector<std::string> inputs;
+    int threads = 1;
+    std::vector<double> weights;
+    bool verbose = false;
+    long untouched = 7;
+  } cfg;
+
+  argparse::ArgumentParser parser;
+  parser.AddPositional("mode").Bind(&cfg.mode);
+  parser.AddPositional("inputs").NumArgs("+").Bind(&cfg.inputs);
+  parser.AddOptional({"-t", "--threads"}).Bind(&cfg.threads);
+  parser.AddOptional("--weights").NumArgs("*").Bind(&cfg.weights);
+  parser.AddOptional("-v").NumArgs(0).Bind(&cfg.verbose);
+  parser.AddOptional("--untouched").Bind(&cfg.untouched);
+
+  const std::vector<std::string> in_args{"run", "a.txt", "b.txt",  "-t", "8",
+                                         "-v",  "--weights", "0.5", "1.5"};
+  parser.ParseAndBind(in_args);
+  EXPECT_EQ(cfg.mode, "run");
+  EXPECT_THAT(cfg.inputs, ::testing::ElementsAreArray({"a.txt", "b.txt"}));
+  EXPECT_EQ(cfg.threads, 8);
+  EXPECT_THAT(cfg.weights, ::testing::ElementsAreArray({0.5, 1.5}));
+  EXPECT_TRUE(cfg.verbose);
+  EXPECT_EQ(cfg.untouched, 7);
+
+  // Parse also writes the bound destinations
+  const auto args = parser.Parse(std::vector<std::string>{"x", "c", "-t", "2"});
+  EXPECT_EQ(cfg.threads, 2);
+  EXPECT_THAT(cfg.inputs, ::testing::ElementsAreArray({"c"}));
+  EXPECT_EQ(args["--threads"].As<int>(), 2);
+
+  EXPECT_THROW(
+      parser.ParseAndBind(std::vector<std::string>{"x", "c", "-t", "many"}),
+      std::invalid_argument);
+
+  // Destinations are only written once the whole parse has succeeded
+  cfg.threads = 2;
+  EXPECT_THROW(parser.ParseAndBind(std::vector<std::string>{
+                   "y", "d", "-t", "3", "-v", "--untouched"}),
+               std::runtime_error);
+  EXPECT_THROW(static_cast<void>(parser.Parse(
+                   std::vector<std::string>{"y", "d", "-t", "3", "--bad"})),
+               std::runtime_error);
+  EXPECT_EQ(cfg.mode, "x");
+  EXPECT_THAT(cfg.inputs, ::testing::ElementsAreArray({"c"}));
+  EXPECT_EQ(cfg.threads, 2);
+  EXPECT_EQ(cfg.untouched, 7);
+
+  // Lazy maps never write them
+  const auto lazy =
+      parser.ParseLazy(std::vector<std::string>{"z", "e", "-t", "5"});
+  EXPECT_EQ(lazy["--threads"].As<int>(), 5);
+  lazy.Validate();
+  EXPECT_EQ(cfg.mode, "x");
+  EXPECT_EQ(cfg.threads, 2);
+}
+
+// Read with a parser of its own, so that binding one parses again from
+// within a parse on the same thread. Both kinds of input are parsed, to
+// reuse the buffers of each.
+struct Resolution {
+  int width = 0;
+  int height = 0;
+};
+
+template <>
+Resolution argparse::FromString<Resolution>(std::string_view str) {
+  static const auto parser = [] {
+    auto parser = std::make_unique<argparse::ArgumentParser>();
+    parser->AddOptional("--width");
+    parser->AddOptional("--height");
+    return parser;
+  }();
+  const std::size_t x = str.find('x');
+  const std::string width{str.substr(0, x)};
+  const std::string height{str.substr(x + 1)};
+  const auto from_args =
+      parser->Parse(std::vector<std::string>{"--width", width});
+  const auto from_line = parser->Parse(std::string_view{"--height " + height});
+  return {from_args["--width"].As<int>(), from_line["--height"].As<int>()};
+}
+
+TEST(ArgumentParser, Bind_parses_again) {
+  Resolution resolution;
+  int verbosity = 0;
+  std::string name;
+  argparse::ArgumentParser parser;
+  parser.AddOptional("-v").Action(argparse::Action::COUNT).Bind(&verbosity);
+  parser.AddOptional("--resolution").Bind(&resolution);
+  parser.AddOptional("--name").Bind(&name);
+
+  const auto args = parser.Parse(std::vector<std::string>{
+      "-v", "--resolution", "640x480", "-v", "--name", "args"});
+  EXPECT_EQ(resolution.width, 640);
+  EXPECT_EQ(resolution.height, 480);
+  EXPECT_EQ(verbosity, 2);
+  EXPECT_EQ(name, "args");
+  EXPECT_EQ(args["-v"].As<int>(), 2);
+  EXPECT_EQ(args["--name"].As<std::string>(), "args");
+
+  const auto line_args = parser.Parse(
+      std::string_view{"-v --resolution 800x600 -v -v --name 'a line'"});
+  EXPECT_EQ(resolution.width, 800);
+  EXPECT_EQ(resolution.height, 600);
+  EXPECT_EQ(verbosity, 3);
+  EXPECT_EQ(name, "a line");
+  EXPECT_EQ(line_args["--name"].As<std::string>(), "a line");
+}
+
+TEST(ArgumentParser, ParseInto) {
+  argparse::ArgumentParser parser;
+  parser.AddPositional("command");
+  parser.AddOptional({"-n", "--count"});
+  parser.AddOptional("--tags").NumArgs("*");
+
+  argparse::ArgumentMap args;
+  const std::vector<std::string> in_args0{"status", "-n", "3", "--tags",
+                                          "a",      "b",  "c"};
+  parser.ParseInto(in_args0, args);
+  EXPECT_EQ(args["command"].As<std::string>(), "status");
+  EXPECT_EQ(args["--count"].As<int>(), 3);
+  EXPECT_THAT(args["--tags"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"a", "b", "c"}));
+
+  const char *in_args1[]{"stop", "--count", "4"};
+  parser.ParseInto(in_args1, args); // Warm up
+  const std::size_t allocations_before = g_num_allocations;
+  parser.ParseInto(in_args1, args);
+  const std::size_t num_allocations = g_num_allocations - allocations_before;
+  EXPECT_EQ(num_allocations, 0);
+
+  EXPECT_EQ(args["command"].As<std::string>(), "stop");
+  EXPECT_EQ(args["-n"].As<int>(), 4);
+  EXPECT_FALSE(args.Contains("--tags")); // Cleared from the previous parse
+  EXPECT_THROW(static_cast<void>(args["--tags"]), std::runtime_error);
+}
+
+TEST(ArgumentParser, negative_numbers_are_values) {
+  argparse::ArgumentParser parser;
+  parser.AddPositional("offset");
+  parser.AddOptional("--scale").NumArgs(2);
+
+  const auto args =
+      parser.Parse(std::vector<std::string>{"-3", "--scale", "-0.5", "2"});
+  EXPECT_EQ(args["offset"].As<int>(), -3);
+  EXPECT_THAT(args["--scale"].AsVector<double>(),
+              ::testing::ElementsAreArray({-0.5, 2.0}));
+
+  // Only numbers written with digits are values
+  EXPECT_THAT(parser.Parse(std::vector<std::string>{"-.5", "--scale", "1e3",
+                                                    "-2.5e-1"})["--scale"]
+                  .AsVector<double>(),
+              ::testing::ElementsAreArray({1000.0, -0.25}));
+  EXPECT_THROW(static_cast<void>(parser.Parse(
+                   std::vector<std::string>{"1", "--scale", "-inf", "2"})),
+               std::runtime_error);
+  EXPECT_THROW(static_cast<void>(
+                   parser.Parse(std::vector<std::string>{"-nan"})),
+               std::runtime_error);
+
+  // A registered flag is matched even if it reads as a number
+  argparse::ArgumentParser digits;
+  digits.AddOptional("-1").NumArgs(0);
+  digits.AddOptional("--n");
+  const auto flagged =
+      digits.Parse(std::vector<std::string>{"-1", "--n", "-2"});
+  EXPECT_TRUE(flagged.Contains("-1"));
+  EXPECT_EQ(flagged["--n"].As<int>(), -2);
+}
+
+TEST(ArgumentParser, parse_command_line) {
+  std::vector<std::string> words;
+  std::vector<std::string> paths;
+  argparse::ArgumentParser parser;
+  parser.AddPositional("words").NumArgs("*").Bind(&words);
+  parser.AddOptional("--paths").NumArgs("+").Bind(&paths);
+
+  parser.ParseAndBind(std::string_view{
+      "  plain\tsingle' quoted  'text \"double \\\"quoted\\\" \\$x \\q\" "
+      "esc\\ aped '' \"\" a\\\nb  --paths /a/very/long/path/name/x "
+      "\"/another/long/path/with spaces/y\"  "});
+  EXPECT_THAT(words, ::testing::ElementsAreArray(
+                         {"plain", "single quoted  text",
+                          "double \"quoted\" $x \\q", "esc aped", "", "",
+                          "ab"}));
+  EXPECT_THAT(paths, ::testing::ElementsAreArray(
+                         {"/a/very/long/path/name/x",
+                          "/another/long/path/with spaces/y"}));
+
+  const auto args = parser.Parse(std::string_view{"one two"});
+  EXPECT_THAT(args["words"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"one", "two"}));
+  EXPECT_EQ(parser.Parse(std::string_view{""})["words"].Size(), 0);
+
+  EXPECT_THROW(parser.ParseAndBind(std::string_view{"'unterminated"}),
+               std::runtime_error);
+  EXPECT_THROW(parser.ParseAndBind(std::string_view{"\"unterminated\\\""}),
+               std::runtime_error);
+
+  argparse::ArgumentMap map;
+  const std::string_view line{"first 'second one' third --paths /tmp/x"};
+  parser.ParseInto(line, map); // Warm up
+  const std::size_t allocations_before = g_num_allocations;
+  parser.ParseInto(line, map);
+  const std::size_t num_allocations = g_num_allocations - allocations_before;
+  EXPECT_EQ(num_allocations, 0);
+  EXPECT_THAT(map["words"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"first", "second one", "third"}));
+}
+
+TEST(ArgumentParser, undefined_option_suggestions) {
+  argparse::ArgumentParser parser;
+  parser.AddOptional({"-t", "--threads"});
+  parser.AddOptional("--thread-pool");
+  parser.AddOptional("--timeout");
+  for (int i = 0; i < 1000; ++i) {
+    parser.AddOptional("--generated-option-" + std::to_string(i));
+  }
+
+  const auto error_message = [&parser](const std::string &option) {
+    try {
+      static_cast<void>(parser.Parse(std::vector<std::string>{option, "1"}));
+    } catch (const std::runtime_error &e) {
+      return std::string{e.what()};
+    }
+    return std::string{};
+  };
+
+  EXPECT_EQ(error_message("--thread"),
+            "Undefined option --thread. Did you mean --threads?");
+  EXPECT_EQ(error_message("--timeuot"),
+            "Undefined option --timeuot. Did you mean --timeout?");
+  EXPECT_THAT(error_message("--generated-optoin-512"),
+              ::testing::StartsWith("Undefined option --generated-optoin-512. "
+                                    "Did you mean --generated-option-512, "));
+  EXPECT_EQ(error_message("--unrelated"), "Undefined option --unrelated.");
+
+  // The index is rebuilt when new flags are added
+  parser.AddOptional("--unrelate");
+  EXPECT_EQ(error_message("--unrelated"),
+            "Undefined option --unrelated. Did you mean --unrelate?");
+}
+
+TEST(ArgumentParser, actions) {
+  std::vector<std::string> bound_includes;
+  int bound_verbosity = 0;
+
+  argparse::ArgumentParser parser;
+  parser.AddOptional({"-I", "--include"})
+      .Action(argparse::Action::APPEND)
+      .Bind(&bound_includes);
+  parser.AddOptional("-D").NumArgs("+").Action(argparse::Action::EXTEND);
+  parser.AddOptional("-v").Action(argparse::Action::COUNT).Bind(
+      &bound_verbosity);
+  parser.AddOptional("-o");
+
+  argparse::ArgumentMap args;
+  parser.ParseInto(
+      std::string_view{"-I a -v --include b -D x=1 y=2 -v -o 1 -D z -I c "
+                       "-o 2 -v"},
+      args);
+  EXPECT_THAT(args["-I"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"a", "b", "c"}));
+  EXPECT_THAT(args["--include"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"a", "b", "c"}));
+  EXPECT_THAT(bound_includes, ::testing::ElementsAreArray({"a", "b", "c"}));
+  EXPECT_THAT(args["-D"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"x=1", "y=2", "z"}));
+  EXPECT_EQ(args["-v"].Size(), 1);
+  EXPECT_EQ(args["-v"].As<int>(), 3);
+  EXPECT_EQ(args["-v"].As<std::string>(), "3");
+  EXPECT_EQ(bound_verbosity, 3);
+  EXPECT_EQ(args["-o"].As<int>(), 2); // Stored values get overwritten
+
+  // Values do not accumulate across parses
+  parser.ParseInto(std::string_view{"-v -I d"}, args);
+  EXPECT_THAT(args["-I"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"d"}));
+  EXPECT_THAT(bound_includes, ::testing::ElementsAreArray({"d"}));
+  EXPECT_EQ(args["-v"].As<long>(), 1);
+  EXPECT_EQ(bound_verbosity, 1);
+  EXPECT_FALSE(args.Contains("-D"));
+
+  const std::vector<std::string> many_includes = [] {
+    std::vector<std::string> in_args;
+    for (int i = 0; i < 10000; ++i) {
+      in_args.push_back("-I");
+      in_args.push_back(std::to_string(i));
+    }
+    return in_args;
+  }();
+  const auto many = parser.Parse(many_includes);
+  EXPECT_EQ(many["-I"].Size(), 10000);
+  EXPECT_EQ(many["-I"].As<int>(9999), 9999);
+
+  // Occurrences of an appended optional are flattened into one list
+  parser.AddOptional("-p").NumArgs(2).Action(argparse::Action::APPEND);
+  const auto pairs = parser.Parse(std::string_view{"-p 1 2 -p 3 4"});
+  EXPECT_THAT(pairs["-p"].AsVector<int>(),
+              ::testing::ElementsAreArray({1, 2, 3, 4}));
+  EXPECT_EQ(pairs["-p"].As<int>(2), 3); // First value of the second -p
+
+  EXPECT_NO_THROW(parser.AddOptional("-q")
+                      .Action(argparse::Action::APPEND)
+                      .NumArgs(argparse::NArgs::NUMERIC));
+  EXPECT_NO_THROW(parser.AddOptional("-c")
+                      .Action(argparse::Action::COUNT)
+                      .NumArgs(argparse::NArgs::NUMERIC));
+  EXPECT_THROW(parser.AddOptional("-x").NumArgs("+").Action(
+                   argparse::Action::APPEND),
+               std::runtime_error);
+  EXPECT_THROW(parser.AddOptional("-z")
+                   .Action(argparse::Action::APPEND)
+                   .NumArgs(argparse::NArgs::ZERO_OR_MORE),
+               std::runtime_error);
+  EXPECT_THROW(
+      parser.AddOptional("-y").Action(argparse::Action::COUNT).NumArgs(1),
+      std::runtime_error);
+  EXPECT_THROW(static_cast<void>(parser.Parse(std::string_view{"-v 1"})),
+               std::runtime_error);
+}
+
+static argparse::ArgumentParser &DefineSchemaTestParser(
+    argparse::ArgumentParser &parser, std::size_t num_generated_options) {
+  parser.IgnoreFirstArgument();
+  parser.AddPositional("input").Help("Input file");
+  parser.AddPositional("rest").NumArgs("*");
+  parser.AddOptional({"-t", "--threads"}).Required(true).Help("Threads");
+  parser.AddOptional("--tags").NumArgs("+");
+  parser.AddOptional("-v").Action(argparse::Action::COUNT);
+  for (std::size_t i = 0; i < num_generated_options; ++i) {
+    parser.AddOptional("--generated-" + std::to_string(i)).NumArgs(0);
+  }
+  return parser;
+}
+
+TEST(Schema, round_trip) {
+  argparse::ArgumentParser definition("Schema test");
+  DefineSchemaTestParser(definition, 100);
+  const std::vector<std::byte> blob = definition.Serialize();
+
+  const argparse::Schema schema{std::span<const std::byte>{blob}};
+  EXPECT_EQ(schema.Description(), "Schema test");
+  EXPECT_TRUE(schema.IgnoreFirstArgument());
+  EXPECT_EQ(schema.NumPositionals(), 2);
+  EXPECT_EQ(schema.GetPositional(1).name, "rest");
+  EXPECT_EQ(schema.GetPositional(1).nargs, argparse::NArgs::ZERO_OR_MORE);
+  EXPECT_EQ(schema.NumOptionals(), 103);
+  EXPECT_EQ(schema.NumRequired(), 1);
+  EXPECT_EQ(schema.GetOptional(schema.GetRequired(0)).help, "Threads");
+  EXPECT_EQ(schema.FindOptional("--threads"), 0);
+  EXPECT_EQ(schema.FindOptional("--generated-42"), 45);
+  EXPECT_FALSE(schema.FindOptional("--generated-100").has_value());
+  EXPECT_EQ(schema.GetOptional(2).action, argparse::Action::COUNT);
+
+  argparse::ArgumentParser parser(schema);
+  const auto args = parser.Parse(std::string_view{
+      "prog in.txt a b -t 4 --tags x y -v --generated-7 -v"});
+  EXPECT_EQ(args["input"].As<std::string>(), "in.txt");
+  EXPECT_THAT(args["rest"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"a", "b"}));
+  EXPECT_EQ(args["--threads"].As<int>(), 4);
+  EXPECT_EQ(args["-t"].As<int>(), 4);
+  EXPECT_THAT(args["--tags"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"x", "y"}));
+  EXPECT_EQ(args["-v"].As<int>(), 2);
+  EXPECT_TRUE(args.Contains("--generated-7"));
+  EXPECT_FALSE(args.Contains("--generated-8"));
+
+  EXPECT_THROW(static_cast<void>(parser.Parse(std::string_view{"prog in"})),
+               std::runtime_error); // -t is required
+  EXPECT_THROW(
+      static_cast<void>(parser.Parse(std::string_view{"prog in -t 1 2"})),
+      std::runtime_error);
+  EXPECT_EQ(parser.Serialize(), blob);
+
+  // Definitions can be added on top of a schema
+  int level = 0;
+  parser.AddOptional("--level").Bind(&level);
+  EXPECT_THROW(parser.AddOptional("--tags"), std::runtime_error);
+  EXPECT_THROW(parser.AddPositional("input"), std::runtime_error);
+  const auto args2 =
+      parser.Parse(std::string_view{"prog in --level 3 -t 1 -v"});
+  EXPECT_EQ(level, 3);
+  EXPECT_EQ(args2["-v"].As<int>(), 1);
+
+  try {
+    static_cast<void>(parser.Parse(std::string_view{"prog in -t 1 --tagz"}));
+    FAIL() << "Undefined option accepted";
+  } catch (const std::runtime_error &e) {
+    EXPECT_STREQ(e.what(), "Undefined option --tagz. Did you mean --tags?");
+  }
+}
+
+TEST(Schema, map_file) {
+  argparse::ArgumentParser definition;
+  DefineSchemaTestParser(definition, 10);
+  const std::vector<std::byte> blob = definition.Serialize();
+
+  const std::string path = ::testing::TempDir() + "argparse_schema.bin";
+  {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(blob.data()),
+               static_cast<std::streamsize>(blob.size()));
+  }
+
+  argparse::ArgumentParser parser(argparse::Schema::Map(path));
+  std::remove(path.c_str());
+
+  const auto args = parser.Parse(std::string_view{"prog in -t 2"});
+  EXPECT_EQ(args["--threads"].As<int>(), 2);
+  EXPECT_THROW(static_cast<void>(argparse::Schema::Map(path)),
+               std::runtime_error);
+}
+
+TEST(Schema, startup_cost_is_constant) {
+  argparse::ArgumentParser small_definition;
+  argparse::ArgumentParser large_definition;
+  DefineSchemaTestParser(small_definition, 10);
+  DefineSchemaTestParser(large_definition, 10000);
+  const argparse::Schema small_schema{small_definition.Serialize()};
+  const argparse::Schema large_schema{large_definition.Serialize()};
+
+  const auto count_allocations = [](const argparse::Schema &schema) {
+    const std::size_t allocations_before = g_num_allocations;
+    const argparse::ArgumentParser parser(schema);
+    return g_num_allocations - allocations_before;
+  };
+  EXPECT_EQ(count_allocations(small_schema), count_allocations(large_schema));
+}
+
+TEST(Schema, invalid_blobs) {
+  argparse::ArgumentParser definition;
+  DefineSchemaTestParser(definition, 1);
+  std::vector<std::byte> blob = definition.Serialize();
+
+  const std::vector<std::byte> truncated(blob.begin(), blob.end() - 1);
+  EXPECT_THROW(argparse::Schema{truncated}, std::runtime_error);
+
+  std::vector<std::byte> bad_version = blob;
+  bad_version[4] = std::byte{99};
+  EXPECT_THROW(argparse::Schema{bad_version}, std::runtime_error);
+
+  // Out of range nargs and action words of the first positional and optional
+  const auto read_word = [&](std::size_t offset) {
+    std::uint32_t word = 0;
+    std::memcpy(&word, blob.data() + offset, sizeof(word));
+    return std::size_t{word};
+  };
+  const std::size_t positionals = read_word(8 * sizeof(std::uint32_t));
+  const std::size_t optionals = read_word(10 * sizeof(std::uint32_t));
+  std::vector<std::byte> bad_nargs = blob;
+  bad_nargs[positionals + 5 * sizeof(std::uint32_t)] = std::byte{99};
+  EXPECT_THROW(static_cast<void>(argparse::Schema{bad_nargs}.GetPositional(0)),
+               std::runtime_error);
+  std::vector<std::byte> bad_action = blob;
+  bad_action[optionals + 7 * sizeof(std::uint32_t)] = std::byte{99};
+  EXPECT_THROW(static_cast<void>(argparse::Schema{bad_action}.GetOptional(0)),
+               std::runtime_error);
+
+  blob[0] = std::byte{'X'};
+  EXPECT_THROW(argparse::Schema{blob}, std::runtime_error);
+  EXPECT_THROW(argparse::Schema{std::vector<std::byte>(8)},
+               std::runtime_error);
+}
+
+TEST(ArgumentParser, AddOptionals) {
+  static constexpr argparse::OptionalSpec TABLE[] = {
+      {.flags = "-t --threads", .help = "Number of threads"},
+      {.flags = "-o --output", .required = true},
+      {.flags = "--sizes", .nargs = "+"},
+      {.flags = "-q", .nargs = "0"},
+  };
+
+  argparse::ArgumentParser parser;
+  parser.AddPositional("input");
+  parser.AddOptionals(TABLE);
+  const auto args =
+      parser.Parse(std::string_view{"in -t 4 --output out --sizes 1 2 -q"});
+  EXPECT_EQ(args["input"].As<std::string>(), "in");
+  EXPECT_EQ(args["--threads"].As<int>(), 4);
+  EXPECT_EQ(args["-o"].As<std::string>(), "out");
+  EXPECT_THAT(args["--sizes"].AsVector<int>(),
+              ::testing::ElementsAreArray({1, 2}));
+  EXPECT_TRUE(args.Contains("-q"));
+  EXPECT_THROW(static_cast<void>(parser.Parse(std::string_view{"in"})),
+               std::runtime_error);
+
+  const argparse::OptionalSpec duplicate[] = {{.flags = "-a -t"}};
+  EXPECT_THROW(parser.AddOptionals(duplicate), std::runtime_error);
+  const argparse::OptionalSpec invalid_flag[] = {{.flags = "a"}};
+  EXPECT_THROW(parser.AddOptionals(invalid_flag), std::runtime_error);
+  const argparse::OptionalSpec no_flags[] = {{.flags = " "}};
+  EXPECT_THROW(parser.AddOptionals(no_flags), std::runtime_error);
+  const argparse::OptionalSpec invalid_nargs[] = {
+      {.flags = "-b", .nargs = "x"}};
+  EXPECT_THROW(parser.AddOptionals(invalid_nargs), std::runtime_error);
+  const argparse::OptionalSpec optional_required[] = {
+      {.flags = "-c", .nargs = "?", .required = true}};
+  EXPECT_THROW(parser.AddOptionals(optional_required), std::runtime_error);
+  const argparse::OptionalSpec append_star[] = {
+      {.flags = "-d", .nargs = "*", .action = argparse::Action::APPEND}};
+  EXPECT_THROW(parser.AddOptionals(append_star), std::runtime_error);
+  const argparse::OptionalSpec duplicate_in_table[] = {{.flags = "-e"},
+                                                       {.flags = "-f -e"}};
+  EXPECT_THROW(parser.AddOptionals(duplicate_in_table), std::runtime_error);
+  EXPECT_THROW(
+      static_cast<void>(parser.Parse(std::string_view{"in -o o -e 1"})),
+      std::runtime_error);
+
+  // Later tables and AddOptional share the flags of earlier tables
+  static constexpr argparse::OptionalSpec MORE[] = {
+      {.flags = "-v --verbose", .action = argparse::Action::COUNT},
+      {.flags = "-I", .action = argparse::Action::APPEND},
+      {.flags = "--level", .default_value = "3"},
+      {.flags = "-e"},
+  };
+  parser.AddOptionals(MORE);
+  parser.AddOptional("--last");
+  const argparse::OptionalSpec redefined[] = {{.flags = "--verbose"}};
+  EXPECT_THROW(parser.AddOptionals(redefined), std::runtime_error);
+  EXPECT_THROW(parser.AddOptional("-I"), std::runtime_error);
+
+  const auto more_args = parser.Parse(
+      std::string_view{"in -o out -v -I a --verbose -I b -e 1 --last 2"});
+  EXPECT_EQ(more_args["-v"].As<int>(), 2);
+  EXPECT_THAT(more_args["-I"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"a", "b"}));
+  EXPECT_EQ(more_args["--level"].As<int>(), 3);
+  EXPECT_EQ(more_args["-e"].As<int>(), 1);
+  EXPECT_EQ(more_args["--last"].As<int>(), 2);
+  EXPECT_EQ(parser.Parse(std::string_view{"in -o o --level 5"})["--level"]
+                .As<int>(),
+            5);
+
+  // Definition order is kept across tables
+  const argparse::Schema schema{parser.Serialize()};
+  ASSERT_EQ(schema.NumOptionals(), 9);
+  EXPECT_EQ(schema.GetOptional(0).help, "Number of threads");
+  EXPECT_EQ(schema.GetOptional(4).action, argparse::Action::COUNT);
+  EXPECT_EQ(schema.GetOptional(8).num_flags, 1);
+}
+
+TEST(ArgumentParser, AddOptionals_allocations) {
+  const auto make_table = [](std::size_t n) {
+    std::vector<std::string> flags;
+    for (std::size_t i = 0; i < n; ++i) {
+      flags.push_back("--option-" + std::to_string(i));
+    }
+    return flags;
+  };
+  const std::vector<std::string> small_flags = make_table(10);
+  const std::vector<std::string> large_flags = make_table(5000);
+  const auto count_allocations = [](const std::vector<std::string> &flags) {
+    std::vector<argparse::OptionalSpec> table;
+    for (const auto &flag : flags) {
+      table.push_back({.flags = flag, .help = "Some help"});
+    }
+    argparse::ArgumentParser parser;
+    const std::size_t allocations_before = g_num_allocations;
+    parser.AddOptionals(table);
+    return g_num_allocations - allocations_before;
+  };
+  EXPECT_EQ(count_allocations(small_flags), count_allocations(large_flags));
+}
+
+TEST(SnapshotPublisher, publish_and_read) {
+  argparse::ArgumentParser parser;
+  parser.AddOptional("--workers");
+
+  argparse::SnapshotPublisher publisher(
+      parser.ParseSnapshot(std::string_view{"--workers 1"}));
+  argparse::SnapshotPublisher::Reader reader(publisher);
+  EXPECT_EQ(reader.Get()["--workers"].As<int>(), 1);
+  EXPECT_EQ(publisher.Version(), 1);
+
+  const std::weak_ptr<const argparse::ArgumentMap> first = publisher.Load();
+  publisher.Publish(parser.ParseSnapshot(std::string_view{"--workers 2"}));
+  EXPECT_EQ(publisher.Version(), 2);
+  EXPECT_FALSE(first.expired()); // Still held by the reader
+  EXPECT_EQ(reader.Get()["--workers"].As<int>(), 2);
+  EXPECT_TRUE(first.expired());
+
+  EXPECT_THROW(publisher.Publish(nullptr), std::runtime_error);
+}
+
+TEST(SnapshotPublisher, concurrent_readers) {
+  argparse::ArgumentParser parser;
+  parser.AddOptional("-a");
+  parser.AddOptional("-b");
+
+  const auto parse = [&](int value) {
+    const std::string line =
+        "-a " + std::to_string(value) + " -b " + std::to_string(value);
+    return parser.ParseSnapshot(std::string_view{line});
+  };
+  argparse::SnapshotPublisher publisher(parse(0));
+
+  constexpr int NUM_PUBLISHES = 200;
+  std::atomic<bool> done = false;
+  std::atomic<bool> consistent = true;
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&] {
+      argparse::SnapshotPublisher::Reader reader(publisher);
+      int last_value = 0;
+      while (!done) {
+        const argparse::ArgumentMap &args = reader.Get();
+        const int a = args["-a"].As<int>();
+        if ((a != args["-b"].As<int>()) || (a < last_value)) {
+          consistent = false;
+        }
+        last_value = a;
+      }
+    });
+  }
+
+  for (int i = 1; i <= NUM_PUBLISHES; ++i) {
+    publisher.Publish(parse(i));
+  }
+  done = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+
+  EXPECT_TRUE(consistent);
+  EXPECT_EQ((*publisher.Load())["-a"].As<int>(), NUM_PUBLISHES);
+}
+
+TEST(ArgumentParser, constraints) {
+  argparse::ArgumentParser parser;
+  parser.AddOptional({"-j", "--json"}).NumArgs(0);
+  parser.AddOptional({"-y", "--yaml"}).NumArgs(0);
+  parser.AddOptional("--tls-cert");
+  parser.AddOptional("--tls-key");
+  parser.AddOptional("--ca");
+  parser.AddOptional({"-i", "--input"});
+  parser.AddOptional("--stdin").NumArgs(0);
+  parser.AddMutuallyExclusive({"--json", "--yaml"});
+  parser.AddMutuallyExclusive({"--input", "--stdin"}, true);
+  parser.AddDependency("--tls-key", {"--tls-cert", "--ca"});
+
+  const auto parse = [&](std::string_view line) {
+    return parser.Parse(line);
+  };
+  EXPECT_NO_THROW(static_cast<void>(parse("-i a")));
+  EXPECT_NO_THROW(static_cast<void>(parse("--stdin -j")));
+  EXPECT_NO_THROW(static_cast<void>(parse("-i a --tls-cert c --ca d")));
+  EXPECT_NO_THROW(
+      static_cast<void>(parse("-i a --tls-key k --tls-cert c --ca d")));
+
+  const auto error = [&](std::string_view line) {
+    try {
+      static_cast<void>(parse(line));
+    } catch (const std::runtime_error &e) {
+      return std::string{e.what()};
+    }
+    return std::string{};
+  };
+  EXPECT_EQ(error("-i a -j -y"),
+            "Options --json, --yaml are mutually exclusive.");
+  EXPECT_EQ(error("-i a --yaml --json"),
+            "Options --json, --yaml are mutually exclusive.");
+  EXPECT_EQ(error("-j"), "One of the options --input, --stdin is required.");
+  EXPECT_EQ(error("-i a --stdin"),
+            "Options --input, --stdin are mutually exclusive.");
+  EXPECT_EQ(error("-i a --tls-key k --ca d"),
+            "Option --tls-key requires --tls-cert, --ca.");
+
+  EXPECT_THROW(parser.AddMutuallyExclusive({"--json"}), std::runtime_error);
+  EXPECT_THROW(parser.AddMutuallyExclusive({"--json", "--xml"}),
+               std::runtime_error);
+  EXPECT_THROW(parser.AddDependency("--tls-key", {}), std::runtime_error);
+}
+
+TEST(ArgumentParser, constraints_across_many_ids) {
+  argparse::ArgumentParser parser;
+  DefineSchemaTestParser(parser, 200);
+  parser.AddMutuallyExclusive({"--generated-3", "--generated-190"});
+  parser.AddDependency("--generated-150",
+                       {"--generated-10", "--generated-130"});
+
+  const auto parse = [&](const std::string &options) {
+    const std::string line = "prog in -t 1 " + options;
+    return parser.Parse(std::string_view{line});
+  };
+  EXPECT_NO_THROW(static_cast<void>(parse("--generated-3 --generated-10")));
+  EXPECT_THROW(static_cast<void>(parse("--generated-3 --generated-190")),
+               std::runtime_error);
+  EXPECT_THROW(static_cast<void>(parse("--generated-150 --generated-10")),
+               std::runtime_error);
+  EXPECT_NO_THROW(static_cast<void>(
+      parse("--generated-150 --generated-10 --generated-130")));
+}
+
+TEST(ArgumentParser, defaults) {
+  argparse::ArgumentParser parser;
+  parser.AddPositional("input");
+  parser.AddPositional("output").NumArgs("?").Default("out.txt");
+  parser.AddOptional({"-t", "--threads"}).Default(4);
+  parser.AddOptional("--ratio").Default(0.5);
+  parser.AddOptional("--name").Default(std::string{"default"});
+  parser.AddOptional("--verbose").NumArgs(0).Default(false);
+  parser.AddOptional("--no-default");
+
+  argparse::ArgumentMap args;
+  parser.ParseInto(std::string_view{"in"}, args);
+  EXPECT_EQ(args["output"].As<std::string>(), "out.txt");
+  EXPECT_EQ(args["-t"].As<int>(), 4);
+  EXPECT_EQ(args["--threads"].As<int>(), 4);
+  EXPECT_EQ(args["--threads"].As<long>(), 4); // Converted through its string
+  EXPECT_EQ(args["--threads"].As<std::string>(), "4");
+  EXPECT_EQ(args["--ratio"].As<double>(), 0.5);
+  EXPECT_EQ(args["--name"].As<std::string>(), "default");
+  EXPECT_FALSE(args["--verbose"].As<bool>());
+  EXPECT_EQ(args["-t"].Size(), 1);
+  EXPECT_FALSE(args.Contains("-t"));
+  EXPECT_FALSE(args.Contains("output"));
+  EXPECT_THROW(static_cast<void>(args["--no-default"]), std::runtime_error);
+
+  parser.ParseInto(std::string_view{"in result.txt -t 8 --name given"}, args);
+  EXPECT_EQ(args["output"].As<std::string>(), "result.txt");
+  EXPECT_EQ(args["-t"].As<int>(), 8);
+  EXPECT_EQ(args["--name"].As<std::string>(), "given");
+  EXPECT_EQ(args["--ratio"].As<double>(), 0.5);
+
+  // Reading a default neither converts nor copies it
+  const std::size_t allocations_before = g_num_allocations;
+  EXPECT_EQ(args["--ratio"].As<double>(), 0.5);
+  EXPECT_EQ(g_num_allocations, allocations_before);
+}
+
+// Defaults are single values; there are no list defaults
+template <typename T>
+concept CanDefault = requires(argparse::Optional &optional, T value) {
+  optional.Default(value);
+};
+static_assert(CanDefault<int> && CanDefault<const char *> &&
+              CanDefault<argparse::ByteSize> &&
+              CanDefault<std::chrono::seconds>);
+static_assert(!CanDefault<std::vector<std::string>>);
+static_assert(!CanDefault<std::vector<int>>);
+
+TEST(ArgumentParser, defaults_outlive_parser) {
+  const argparse::ArgumentSnapshot snapshot = [] {
+    argparse::ArgumentParser parser;
+    parser.AddOptional("--port").Default(8080);
+    return parser.ParseSnapshot(std::string_view{""});
+  }();
+  EXPECT_EQ((*snapshot)["--port"].As<int>(), 8080);
+}
+
+TEST(ArgumentParser, defaults_changed_after_parse) {
+  argparse::ArgumentParser parser;
+  argparse::Optional &port = parser.AddOptional("--port").Default(8080);
+  parser.EnableParseCache(4);
+
+  const auto before = parser.ParseSnapshot(std::string_view{""});
+  EXPECT_EQ(parser.ParseSnapshot(std::string_view{""}), before);
+  port.Default(9090);
+
+  // Earlier parses keep the defaults they saw, and the cache is invalidated
+  const auto after = parser.ParseSnapshot(std::string_view{""});
+  EXPECT_NE(after, before);
+  EXPECT_EQ((*before)["--port"].As<int>(), 8080);
+  EXPECT_EQ((*after)["--port"].As<int>(), 9090);
+}
+
+TEST(Argument, AsByteSize) {
+  using argparse::ByteSize;
+  const auto as_size = [](std::string_view value) {
+    return argparse::Argument(std::span{&value, 1}).As<ByteSize>();
+  };
+  EXPECT_EQ(as_size("4096"), ByteSize{4096});
+  EXPECT_EQ(as_size("12B"), ByteSize{12});
+  EXPECT_EQ(as_size("10kB"), ByteSize{10000});
+  EXPECT_EQ(as_size("512MiB"), ByteSize{512ULL << 20});
+  EXPECT_EQ(as_size("3GB"), ByteSize{3000000000ULL});
+  EXPECT_EQ(as_size("2TiB"), ByteSize{2ULL << 40});
+  EXPECT_EQ(as_size("15EiB"), ByteSize{15ULL << 60});
+  EXPECT_THROW(as_size("16EiB"), std::out_of_range);
+  EXPECT_THROW(as_size("99999999999999999999"), std::out_of_range);
+  EXPECT_THROW(as_size("10 MiB"), std::invalid_argument);
+  EXPECT_THROW(as_size("10mib"), std::invalid_argument);
+  EXPECT_THROW(as_size("MiB"), std::invalid_argument);
+  EXPECT_THROW(as_size("-1"), std::invalid_argument);
+
+  // Parsing does not allocate
+  const std::string_view value = "256KiB";
+  const argparse::Argument argument(std::span{&value, 1});
+  const std::size_t allocations_before = g_num_allocations;
+  EXPECT_EQ(argument.As<ByteSize>().bytes, 256 * 1024);
+  EXPECT_EQ(g_num_allocations, allocations_before);
+}
+
+TEST(Argument, AsDuration) {
+  using namespace std::chrono_literals;
+  const auto arg = [](std::string_view value) {
+    return argparse::Argument(std::span{&value, 1});
+  };
+  EXPECT_EQ(arg("250ms").As<std::chrono::nanoseconds>(), 250ms);
+  EXPECT_EQ(arg("250ms").As<std::chrono::milliseconds>(), 250ms);
+  EXPECT_EQ(arg("15us").As<std::chrono::microseconds>(), 15us);
+  EXPECT_EQ(arg("90s").As<std::chrono::seconds>(), 90s);
+  EXPECT_EQ(arg("120min").As<std::chrono::hours>(), 2h);
+  EXPECT_EQ(arg("2d").As<std::chrono::minutes>(), 48h);
+  EXPECT_EQ(arg("7ns").As<std::chrono::nanoseconds>(), 7ns);
+  EXPECT_THROW(static_cast<void>(arg("1500ms").As<std::chrono::seconds>()),
+               std::invalid_argument);
+  EXPECT_THROW(static_cast<void>(arg("10").As<std::chrono::seconds>()),
+               std::invalid_argument);
+  EXPECT_THROW(static_cast<void>(arg("10sec").As<std::chrono::seconds>()),
+               std::invalid_argument);
+  EXPECT_THROW(static_cast<void>(arg("300000d").As<std::chrono::hours>()),
+               std::out_of_range);
+
+  const std::vector<std::string> values = {"1s", "2min"};
+  EXPECT_THAT(argparse::Argument(values).AsVector<std::chrono::seconds>(),
+              ::testing::ElementsAreArray({1s, 120s}));
+}
+
+TEST(Argument, AsRate) {
+  const auto arg = [](std::string_view value) {
+    return argparse::Argument(std::span{&value, 1});
+  };
+  EXPECT_DOUBLE_EQ(arg("100/s").As<argparse::Rate>().per_second, 100);
+  EXPECT_DOUBLE_EQ(arg("30/min").As<argparse::Rate>().per_second, 0.5);
+  EXPECT_DOUBLE_EQ(arg("5k/10s").As<argparse::Rate>().per_second, 500);
+  EXPECT_DOUBLE_EQ(arg("1/100ms").As<argparse::Rate>().per_second, 10);
+  EXPECT_DOUBLE_EQ(arg("10MiB/s").As<argparse::ByteRate>().bytes_per_second,
+                   10 * 1024 * 1024);
+  EXPECT_DOUBLE_EQ(arg("1GB/h").As<argparse::ByteRate>().bytes_per_second,
+                   1e9 / 3600);
+  EXPECT_THROW(static_cast<void>(arg("100").As<argparse::Rate>()),
+               std::invalid_argument);
+  EXPECT_THROW(static_cast<void>(arg("100/0s").As<argparse::Rate>()),
+               std::invalid_argument);
+  EXPECT_THROW(static_cast<void>(arg("100/parsec").As<argparse::Rate>()),
+               std::invalid_argument);
+  EXPECT_THROW(static_cast<void>(arg("1MiB/s").As<argparse::Rate>()),
+               std::invalid_argument);
+}
+
+TEST(ArgumentParser, parse_cache) {
+  argparse::ArgumentParser parser;
+  parser.AddOptional("--user");
+  parser.AddOptional("--limit");
+
+  // Without the cache, every parse gives a new snapshot
+  const auto uncached = parser.ParseSnapshot(std::string_view{"--user a"});
+  EXPECT_NE(uncached, parser.ParseSnapshot(std::string_view{"--user a"}));
+  EXPECT_EQ(parser.GetParseCacheStats().misses, 0);
+
+  parser.EnableParseCache(2);
+  const auto first = parser.ParseSnapshot(std::string_view{"--user a"});
+  EXPECT_EQ(first, parser.ParseSnapshot(std::string_view{"--user a"}));
+  EXPECT_EQ((*first)["--user"].As<std::string>(), "a");
+
+  const std::vector<std::string> tokens = {"--user", "a"};
+  const auto from_tokens = parser.ParseSnapshot(tokens);
+  EXPECT_NE(first, from_tokens);
+  EXPECT_EQ(from_tokens, parser.ParseSnapshot(tokens));
+  EXPECT_EQ(parser.GetParseCacheStats().hits, 2);
+  EXPECT_EQ(parser.GetParseCacheStats().misses, 2);
+
+  // Tokens are delimited, so splitting them differently is another key
+  const std::vector<std::string> apart = {"--user", "a", "--limit", "1"};
+  const std::vector<std::string> together = {"--user", "a--limit1"};
+  EXPECT_EQ((*parser.ParseSnapshot(apart))["--limit"].As<int>(), 1);
+  EXPECT_EQ((*parser.ParseSnapshot(together))["--user"].As<std::string>(),
+            "a--limit1");
+
+  // The least recently used line is evicted
+  EXPECT_NE(first, parser.ParseSnapshot(std::string_view{"--user a"}));
+  EXPECT_EQ(parser.GetParseCacheStats().hits, 2);
+  EXPECT_EQ(parser.GetParseCacheStats().misses, 5);
+}
+
+TEST(ArgumentParser, parse_cache_invalidation) {
+  argparse::ArgumentParser parser;
+  argparse::Optional &limit = parser.AddOptional("--limit");
+  parser.EnableParseCache(8);
+
+  const std::string_view line = "--limit 1 2";
+  EXPECT_THROW(static_cast<void>(parser.ParseSnapshot(line)),
+               std::runtime_error);
+  limit.NumArgs(2);
+  const auto two_values = parser.ParseSnapshot(line);
+  EXPECT_EQ((*two_values)["--limit"].Size(), 2);
+  EXPECT_EQ(two_values, parser.ParseSnapshot(line));
+
+  parser.AddOptional("--other");
+  EXPECT_NE(two_values, parser.ParseSnapshot(line));
+  limit.Required(true);
+  EXPECT_THROW(static_cast<void>(parser.ParseSnapshot(
+                   std::string_view{"--other 1"})),
+               std::runtime_error);
+
+  const std::string_view both = "--limit 1 2 --other 1";
+  EXPECT_NO_THROW(static_cast<void>(parser.ParseSnapshot(both)));
+  parser.AddMutuallyExclusive({"--limit", "--other"});
+  EXPECT_THROW(static_cast<void>(parser.ParseSnapshot(both)),
+               std::runtime_error);
+}
+
+TEST(ArgumentParser, environment) {
+  setenv("ARGPARSE_TEST_THREADS", "8", 1);
+  setenv("ARGPARSE_TEST_VERBOSE", "yes", 1);
+  setenv("ARGPARSE_TEST_QUIET", "off", 1);
+  setenv("ARGPARSE_TEST_TAGS", "a b  c", 1);
+  setenv("ARGPARSE_TEST_LEVEL", "3", 1);
+  setenv("ARGPARSE_TEST_OUTPUT", "out.txt", 1);
+
+  int bound_threads = 0;
+  argparse::ArgumentParser parser;
+  parser.AddOptional({"-t", "--threads"})
+      .Env("ARGPARSE_TEST_THREADS")
+      .Bind(&bound_threads);
+  parser.AddOptional("--verbose").NumArgs(0).Env("ARGPARSE_TEST_VERBOSE");
+  parser.AddOptional("--quiet").NumArgs(0).Env("ARGPARSE_TEST_QUIET");
+  parser.AddOptional("--tags").NumArgs("+").Env("ARGPARSE_TEST_TAGS");
+  parser.AddOptional("-v").Action(argparse::Action::COUNT).Env(
+      "ARGPARSE_TEST_LEVEL");
+  parser.AddOptional("-o").Required(true).Env("ARGPARSE_TEST_OUTPUT");
+  parser.AddOptional("--unset").Env("ARGPARSE_TEST_UNSET");
+
+  const auto args = parser.Parse(std::string_view{""});
+  EXPECT_EQ(args["--threads"].As<int>(), 8);
+  EXPECT_EQ(args["-t"].As<int>(), 8);
+  EXPECT_EQ(bound_threads, 8);
+  EXPECT_TRUE(args.Contains("--verbose"));
+  EXPECT_FALSE(args.Contains("--quiet"));
+  EXPECT_THAT(args["--tags"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"a", "b", "c"}));
+  EXPECT_EQ(args["-v"].As<int>(), 3);
+  EXPECT_EQ(args["-o"].As<std::string>(), "out.txt");
+  EXPECT_FALSE(args.Contains("--unset"));
+
+  // The command line takes precedence
+  const auto given = parser.Parse(std::string_view{"-t 2 -v --tags x -o o"});
+  EXPECT_EQ(given["-t"].As<int>(), 2);
+  EXPECT_EQ(given["-v"].As<int>(), 1);
+  EXPECT_THAT(given["--tags"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"x"}));
+  EXPECT_EQ(given["-o"].As<std::string>(), "o");
+
+  // Lazy maps read the environment when parsed, like eager parses
+  const auto lazy = parser.ParseLazy(std::string_view{"-v"});
+  setenv("ARGPARSE_TEST_THREADS", "9", 1);
+  EXPECT_EQ(lazy["-t"].As<int>(), 8);
+  EXPECT_EQ(lazy["-v"].As<int>(), 1);
+  EXPECT_FALSE(lazy.Contains("--quiet"));
+  EXPECT_THAT(lazy["--tags"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"a", "b", "c"}));
+  EXPECT_NO_THROW(lazy.Validate());
+  setenv("ARGPARSE_TEST_THREADS", "8", 1);
+
+  // Cached snapshots follow the environment
+  parser.EnableParseCache(4);
+  const auto before = parser.ParseSnapshot(std::string_view{""});
+  setenv("ARGPARSE_TEST_THREADS", "16", 1);
+  const auto after = parser.ParseSnapshot(std::string_view{""});
+  EXPECT_EQ((*before)["-t"].As<int>(), 8);
+  EXPECT_EQ((*after)["-t"].As<int>(), 16);
+
+  setenv("ARGPARSE_TEST_VERBOSE", "maybe", 1);
+  EXPECT_THROW(static_cast<void>(parser.Parse(std::string_view{""})),
+               std::invalid_argument);
+  unsetenv("ARGPARSE_TEST_VERBOSE");
+  unsetenv("ARGPARSE_TEST_OUTPUT");
+  EXPECT_THROW(static_cast<void>(parser.Parse(std::string_view{""})),
+               std::runtime_error);
+
+  // A false switch or a zero count does not satisfy Required
+  argparse::ArgumentParser required;
+  required.AddOptional("--quiet").NumArgs(0).Required(true).Env(
+      "ARGPARSE_TEST_QUIET");
+  EXPECT_THROW(static_cast<void>(required.Parse(std::string_view{""})),
+               std::runtime_error);
+  setenv("ARGPARSE_TEST_QUIET", "on", 1);
+  EXPECT_TRUE(required.Parse(std::string_view{""}).Contains("--quiet"));
+  argparse::ArgumentParser counted;
+  counted.AddOptional("-v")
+      .Action(argparse::Action::COUNT)
+      .Required(true)
+      .Env("ARGPARSE_TEST_LEVEL");
+  setenv("ARGPARSE_TEST_LEVEL", "0", 1);
+  EXPECT_THROW(static_cast<void>(counted.Parse(std::string_view{""})),
+               std::runtime_error);
+
+  for (const char *name : {"ARGPARSE_TEST_THREADS", "ARGPARSE_TEST_QUIET",
+                           "ARGPARSE_TEST_TAGS", "ARGPARSE_TEST_LEVEL"}) {
+    unsetenv(name);
+  }
+  EXPECT_THROW(parser.AddOptional("--bad").Env("A=B"), std::runtime_error);
+}
+
+TEST(ArgumentParser, ParseLazy) {
+  argparse::ArgumentParser parser;
+  DefineSchemaTestParser(parser, 500);
+  parser.AddOptional("--level").Default(3);
+
+  const auto args = parser.ParseLazy(
+      std::string_view{"prog in a b -t 4 --generated-7 --tags x y --tags z "
+                       "-v -v --undefined"});
+  EXPECT_EQ(args["-t"].As<int>(), 4);
+  EXPECT_EQ(args["--threads"].As<int>(), 4);
+  EXPECT_TRUE(args.Contains("--generated-7"));
+  EXPECT_FALSE(args.Contains("--generated-8"));
+  EXPECT_THAT(args["--tags"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"z"}));
+  EXPECT_EQ(args["-v"].As<int>(), 2);
+  EXPECT_EQ(args["input"].As<std::string>(), "in");
+  EXPECT_THAT(args["rest"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"a", "b"}));
+  EXPECT_EQ(args["--level"].As<int>(), 3);
+  EXPECT_THROW(static_cast<void>(args["--missing"]), std::runtime_error);
+
+  // Errors in arguments that were never read surface on validation
+  EXPECT_THROW(args.Validate(), std::runtime_error);
+
+  const auto missing_required =
+      parser.ParseLazy(std::string_view{"prog in --generated-1"});
+  EXPECT_TRUE(missing_required.Contains("--generated-1"));
+  EXPECT_THROW(missing_required.Validate(), std::runtime_error);
+
+  const auto valid =
+      parser.ParseLazy(std::string_view{"prog in -t 1 --tags a"});
+  EXPECT_NO_THROW(valid.Validate());
+  EXPECT_EQ(valid["-t"].As<int>(), 1);
+  EXPECT_THAT(valid["--tags"].AsVector<std::string>(),
+              ::testing::ElementsAreArray({"a"}));
+}
+
+TEST(ArgumentParser, ParseLazy_references_survive_validation) {
+  argparse::ArgumentParser parser;
+  parser.AddOptional("--a");
+  parser.AddOptional("--b");
+
+  const auto args = parser.ParseLazy(std::string_view{"--a x --b 2"});
+  const argparse::Argument &a = args["--a"];
+  const argparse::Argument *address = &a;
+  args.Validate();
+  EXPECT_EQ(&args["--a"], address);
+  EXPECT_EQ(a.As<std::string>(), "x");
+  EXPECT_EQ(args["--b"].As<int>(), 2);
+}
+
+TEST(ArgumentParser, ParseLazy_errors_repeat) {
+  argparse::ArgumentParser parser;
+  parser.AddOptional("--n").NumArgs(2);
+
+  const auto args = parser.ParseLazy(std::string_view{"--n 1 2 --n 3"});
+  for (int i = 0; i < 2; ++i) {
+    try {
+      static_cast<void>(args["--n"]);
+      FAIL() << "Wrong number of arguments accepted";
+    } catch (const std::runtime_error &e) {
+      EXPECT_STREQ(e.what(), "Option --n expected 2 arguments but found 1.");
+    }
+  }
+  EXPECT_THROW(static_cast<void>(args.Contains("--n")), std::runtime_error);
+}
+
+TEST(ArgumentParser, ParseLazy_cost) {
+  const std::vector<std::string> args = {"--option-1", "1", "--option-2", "2"};
+  const auto count_allocations = [&args](std::size_t num_options) {
+    argparse::ArgumentParser parser;
+    for (std::size_t i = 0; i < num_options; ++i) {
+      parser.AddOptional("--option-" + std::to_string(i)).Default(0);
+    }
+
+    // The first lazy parse of the parser, and one read
+    const std::size_t allocations_before = g_num_allocations;
+    const auto map = parser.ParseLazy(args);
+    EXPECT_EQ(map["--option-1"].As<int>(), 1);
+    return g_num_allocations - allocations_before;
+  };
+
+  // Per-thread buffers grow once, with any parser
+  argparse::ArgumentParser warm_up;
+  static_cast<void>(warm_up.ParseLazy(args));
+  EXPECT_EQ(count_allocations(10), count_allocations(1000));
+}
+
+TEST(ArgumentParser, copy_on_write) {
+  argparse::ArgumentParser parser;
+  DefineSchemaTestParser(parser, 1000);
+  parser.AddOptional("--port").Default(8080);
+  parser.AddMutuallyExclusive({"--generated-0", "--generated-1"});
+
+  // Copies share the definitions until one of them changes
+  const std::size_t allocations_before = g_num_allocations;
+  argparse::ArgumentParser copy = parser;
+  EXPECT_EQ(g_num_allocations, allocations_before);
+
+  copy.AddOptional("--extra");
+  copy.AddOptional("--port-2").Default(9090);
+  const auto copied = copy.Parse(std::string_view{"prog in -t 2 --extra x -v"});
+  EXPECT_EQ(copied["--extra"].As<std::string>(), "x");
+  EXPECT_EQ(copied["--port"].As<int>(), 8080);
+  EXPECT_EQ(copied["--port-2"].As<int>(), 9090);
+  EXPECT_EQ(copied["-v"].As<int>(), 1);
+  EXPECT_THROW(static_cast<void>(copy.Parse(std::string_view{
+                   "prog in -t 2 --generated-0 --generated-1"})),
+               std::runtime_error);
+
+  // The original is unchanged
+  EXPECT_THROW(static_cast<void>(parser.Parse(std::string_view{
+                   "prog in -t 2 --extra x"})),
+               std::runtime_error);
+  const auto original = parser.Parse(std::string_view{"prog in -t 2"});
+  EXPECT_THROW(static_cast<void>(original["--port-2"]), std::runtime_error);
+  EXPECT_EQ(original["--port"].As<int>(), 8080);
+
+  // A copy keeps working after the original is gone
+  auto survivor = std::make_unique<argparse::ArgumentParser>(parser);
+  parser = argparse::ArgumentParser{};
+  const auto survived = survivor->Parse(std::string_view{"prog in -t 3"});
+  EXPECT_EQ(survived["-t"].As<int>(), 3);
+  EXPECT_EQ(survived["--port"].As<int>(), 8080);
+}
+
+TEST(ArgumentParser, Fork) {
+  argparse::ArgumentParser base;
+  base.AddOptional("--verbose").NumArgs(0);
+
+  std::vector<argparse::ArgumentParser> plugins;
+  for (int i = 0; i < 3; ++i) {
+    argparse::ArgumentParser &plugin = plugins.emplace_back(base.Fork());
+    plugin.AddOptional("--plugin-" + std::to_string(i));
+  }
+
+  for (int i = 0; i < 3; ++i) {
+    const std::string flag = "--plugin-" + std::to_string(i);
+    const auto args = plugins[static_cast<std::size_t>(i)].Parse(
+        std::string_view{"--verbose " + flag + " value"});
+    EXPECT_TRUE(args.Contains("--verbose"));
+    EXPECT_EQ(args[flag].As<std::string>(), "value");
+  }
+  EXPECT_THROW(static_cast<void>(base.Parse(std::string_view{"--plugin-0 x"})),
+               std::runtime_error);
+
+  argparse::ArgumentParser nested = plugins[0].Fork();
+  nested.AddOptional("--nested").Default(1);
+  const auto args =
+      nested.Parse(std::string_view{"--verbose --plugin-0 x"});
+  EXPECT_TRUE(args.Contains("--verbose"));
+  EXPECT_EQ(args["--plugin-0"].As<std::string>(), "x");
+  EXPECT_EQ(args["--nested"].As<int>(), 1);
+  EXPECT_THROW(static_cast<void>(
+                   plugins[0].Parse(std::string_view{"--nested 2"})),
+               std::runtime_error);
+}
+
+TEST(ArgumentParser, Fork_cost) {
+  // Forking and extending does not depend on the size of the base
+  const auto count_allocations = [](std::size_t num_options) {
+    argparse::ArgumentParser base;
+    DefineSchemaTestParser(base, num_options);
+    base.AddOptional("--port").Default(8080);
+
+    const std::size_t allocations_before = g_num_allocations;
+    argparse::ArgumentParser fork = base.Fork();
+    fork.AddOptional("--plugin").Default(1);
+    base.AddOptional("--base-only");
+    const std::size_t allocations = g_num_allocations - allocations_before;
+
+    const auto args =
+        fork.Parse(std::string_view{"prog in -t 2 --plugin 3 --generated-1"});
+    EXPECT_EQ(args["--plugin"].As<int>(), 3);
+    EXPECT_EQ(args["--port"].As<int>(), 8080);
+    EXPECT_TRUE(args.Contains("--generated-1"));
+    EXPECT_THROW(static_cast<void>(fork.Parse(std::string_view{
+                     "prog in -t 2 --base-only x"})),
+                 std::runtime_error);
+    return allocations;
+  };
+  EXPECT_EQ(count_allocations(10), count_allocations(1000));
+}
+
+TEST(ArgumentParser, definitions_changed_after_ParseLazy) {
+  argparse::ArgumentParser parser;
+  argparse::Optional &port = parser.AddOptional("--port");
+  const auto lazy = parser.ParseLazy(std::string_view{""});
+
+  // Changes through a reference held across ParseLazy reach the parser
+  int bound = 0;
+  parser.AddOptional("--host");
+  port.Default(9090).Bind(&bound);
+  EXPECT_EQ(parser.Parse(std::string_view{""})["--port"].As<int>(), 9090);
+  static_cast<void>(parser.Parse(std::string_view{"--port 1"}));
+  EXPECT_EQ(bound, 1);
+
+  // The lazy map keeps the definitions it was parsed with
+  EXPECT_THROW(static_cast<void>(lazy["--port"]), std::runtime_error);
+  EXPECT_THROW(static_cast<void>(lazy["--host"]), std::runtime_error);
+  const auto later = parser.ParseLazy(std::string_view{"--host h"});
+  EXPECT_EQ(later["--host"].As<std::string>(), "h");
+  EXPECT_EQ(later["--port"].As<int>(), 9090);
+}
+
+TEST(ArgumentParser, moved_from_parser_is_empty) {
+  argparse::ArgumentParser parser;
+  parser.AddOptional("--x");
+  argparse::ArgumentParser moved = std::move(parser);
+  EXPECT_EQ(moved.Parse(std::string_view{"--x 1"})["--x"].As<int>(), 1);
+
+  EXPECT_THROW(static_cast<void>(parser.Parse(std::string_view{"--x 1"})),
+               std::runtime_error);
+  parser.AddOptional("--y");
+  EXPECT_EQ(parser.Parse(std::string_view{"--y 2"})["--y"].As<int>(), 2);
+
+  argparse::ArgumentParser assigned;
+  assigned = std::move(moved);
+  EXPECT_NO_THROW(static_cast<void>(moved.Parse(std::string_view{""})));
+  EXPECT_THROW(static_cast<void>(moved.Parse(std::string_view{"--y 2"})),
+               std::runtime_error);
+}
+
+TEST(ArgumentParser, ParseLazy_outlives_parser) {
+  const argparse::ArgumentMap args = [] {
+    argparse::ArgumentParser parser;
+    parser.AddPositional("input");
+    parser.AddOptional("--port").Default(8080);
+    return parser.ParseLazy(std::string_view{"in"});
+  }();
+  EXPECT_EQ(args["input"].As<std::string>(), "in");
+  EXPECT_EQ(args["--port"].As<int>(), 8080);
+}
+
+static argparse::ArgumentParser &DefineViewTestParser(
+    argparse::ArgumentParser &parser) {
+  parser.AddPositional("input");
+  parser.AddOptional({"-t", "--threads"}).Default(4);
+  parser.AddOptional("--tags").NumArgs("+");
+  parser.AddOptional("-v").Action(argparse::Action::COUNT);
+  parser.AddOptional("--name").Default("worker");
+  return parser;
+}
+
+TEST(ArgumentView, round_trip) {
+  argparse::ArgumentParser parser;
+  DefineViewTestParser(parser);
+  const std::string_view line = "in --tags a bb ccc -v -v --threads 8";
+
+  for (const auto &map : {parser.Parse(line), parser.ParseLazy(line)}) {
+    const argparse::ArgumentView view{map.Serialize()};
+    EXPECT_EQ(view["input"].As<std::string>(), "in");
+    EXPECT_EQ(view["-t"].As<int>(), 8);
+    EXPECT_EQ(view["--threads"].As<int>(), 8);
+    EXPECT_EQ(view["--tags"].AsVector<std::string>(),
+              (std::vector<std::string>{"a", "bb", "ccc"}));
+    EXPECT_EQ(view["-v"].As<int>(), 2);
+    EXPECT_EQ(view["-v"].Size(), 1);
+    EXPECT_EQ(view["--name"].Get(0), "worker");
+    EXPECT_TRUE(view.Contains("--tags"));
+    EXPECT_FALSE(view.Contains("--name"));
+    EXPECT_FALSE(view.Contains("--undefined"));
+    EXPECT_THROW(static_cast<void>(view["--undefined"]), std::runtime_error);
+    EXPECT_THROW(static_cast<void>(view["--tags"].Get(3)), std::out_of_range);
+  }
+
+  // Reading a view neither parses nor copies
+  const argparse::ArgumentView view{parser.Parse(line).Serialize()};
+  const std::size_t allocations_before = g_num_allocations;
+  EXPECT_EQ(view["--tags"].Get(2), "ccc");
+  EXPECT_EQ(view["--threads"].As<int>(), 8);
+  EXPECT_EQ(g_num_allocations, allocations_before);
+}
+
+TEST(ArgumentView, typed_defaults) {
+  argparse::ArgumentParser parser;
+  parser.AddOptional("--size").Default(argparse::ByteSize{10});
+  parser.AddOptional("--timeout").Default(std::chrono::milliseconds{250});
+  parser.AddOptional("--rate").Default(argparse::Rate{0.5});
+  parser.AddOptional("--bandwidth").Default(argparse::ByteRate{1024});
+
+  const auto args = parser.Parse(std::string_view{""});
+  EXPECT_EQ(args["--size"].As<std::string>(), "10");
+  EXPECT_EQ(args["--timeout"].As<std::string>(), "250ms");
+  EXPECT_EQ(args["--rate"].As<std::string>(), "30/min");
+  EXPECT_EQ(args["--size"].As<int>(), 10);
+
+  const argparse::ArgumentView view{args.Serialize()};
+  EXPECT_EQ(view["--size"].As<argparse::ByteSize>(), argparse::ByteSize{10});
+  EXPECT_EQ(view["--timeout"].As<std::chrono::milliseconds>(),
+            std::chrono::milliseconds{250});
+  EXPECT_EQ(view["--rate"].As<argparse::Rate>(), argparse::Rate{0.5});
+  EXPECT_EQ(view["--bandwidth"].As<argparse::ByteRate>(),
+            argparse::ByteRate{1024});
+
+  EXPECT_EQ(argparse::ToString(argparse::Rate{1.0 / 3}), "20/min");
+  EXPECT_EQ(argparse::ToString(argparse::Rate{1.0 / 7}), "1234286/100d");
+  EXPECT_EQ(argparse::FromString<argparse::Rate>(
+                argparse::ToString(argparse::Rate{2.5})),
+            argparse::Rate{2.5});
+}
+
+TEST(ArgumentView, floating_point_defaults) {
+  argparse::ArgumentParser parser;
+  parser.AddOptional("--eps").Default(1e-9);
+  parser.AddOptional("--limit").Default(1e300);
+  parser.AddOptional("--ratio").Default(0.1F);
+
+  const auto args = parser.Parse(std::string_view{""});
+  EXPECT_EQ(args["--eps"].As<float>(), 1e-9F);
+  EXPECT_EQ(args["--eps"].As<double>(), 1e-9);
+  EXPECT_EQ(args["--limit"].As<double>(), 1e300);
+  EXPECT_THROW(static_cast<void>(args["--limit"].As<float>()),
+               std::out_of_range);
+  EXPECT_EQ(args["--ratio"].As<std::string>(), "0.1");
+
+  const argparse::ArgumentView view{args.Serialize()};
+  EXPECT_EQ(view["--eps"].As<float>(), 1e-9F);
+  EXPECT_EQ(view["--eps"].As<double>(), 1e-9);
+  EXPECT_EQ(view["--limit"].As<double>(), 1e300);
+  EXPECT_EQ(view["--ratio"].As<float>(), 0.1F);
+}
+
+TEST(ArgumentView, invalid_blobs) {
+  argparse::ArgumentParser parser;
+  DefineViewTestParser(parser);
+  std::vector<std::byte> blob =
+      parser.Parse(std::string_view{"in --tags a"}).Serialize();
+
+  const std::vector<std::byte> truncated(blob.begin(), blob.end() - 1);
+  EXPECT_THROW(argparse::ArgumentView{truncated}, std::runtime_error);
+
+  blob[0] = std::byte{'X'};
+  EXPECT_THROW(argparse::ArgumentView{blob}, std::runtime_error);
+  EXPECT_THROW(argparse::ArgumentView{parser.Serialize()}, std::runtime_error);
+}
+
+TEST(ArgumentParser, help) {
+  argparse::ArgumentParser parser("Copies files, wrapping this description.");
+  parser.AddPositional("input").Help("Input file");
+  parser.AddPositional("rest").NumArgs("*").Help(
+      "Passed through to the underlying tool unchanged");
+  parser.AddOptional({"-t", "--threads"}).Help("Threads");
+  parser.AddOptional("--an-option-with-a-long-name").NumArgs(2).Help("Long");
+  parser.AddOptional("-v").Action(argparse::Action::COUNT);
+
+  std::ostringstream out;
+  parser.PrintHelp(out, 40);
+  EXPECT_EQ(out.str(), "Copies files, wrapping this description.\n"
+                       "\n"
+                       "positional arguments:\n"
+                       "  input          Input file\n"
+                       "  rest [*]       Passed through to the\n"
+                       "                 underlying tool\n"
+                       "                 unchanged\n"
+                       "\n"
+                       "optional arguments:\n"
+                       "  -t, --threads  Threads\n"
+                       "  --an-option-with-a-long-name [2]\n"
+                       "                 Long\n"
+                       "  -v\n");
+
+  // Rendered once per width and definitions
+  std::vector<char> buffer(out.str().size());
+  const std::size_t allocations_before = g_num_allocations;
+  EXPECT_EQ(parser.FormatHelp(buffer, 40), buffer.size());
+  EXPECT_EQ(g_num_allocations, allocations_before);
+  EXPECT_EQ(std::string_view(buffer.data(), buffer.size()), out.str());
+
+  std::array<char, 4> small{};
+  EXPECT_EQ(parser.FormatHelp(small, 40), buffer.size());
+  EXPECT_EQ(small[0], '\0');
+
+  parser.AddOptional("--added").Help("Added later");
+  std::ostringstream changed;
+  parser.PrintHelp(changed, 40);
+  EXPECT_THAT(changed.str(),
+              ::testing::HasSubstr("  --added        Added later\n"));
+}
+
+#if defined(ARGPARSE_TEST_FORK)
+TEST(ArgumentView, shared_memory) {
+  argparse::ArgumentParser parser;
+  DefineViewTestParser(parser);
+  const int fd = parser.Parse(std::string_view{"in --tags a b -v"})
+                     .SerializeToMemory();
+  ASSERT_GE(fd, 0);
+
+  const pid_t pid = ::fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    const auto view = argparse::ArgumentView::Map(fd);
+    const bool ok = (view["input"].As<std::string>() == "in") &&
+                    (view["--tags"].Get(1) == "b") &&
+                    (view["-v"].As<int>() == 1) &&
+                    (view["--threads"].As<int>() == 4);
+    ::_exit(ok ? 0 : 1);
+  }
+
+  int status = 0;
+  ASSERT_EQ(::waitpid(pid, &status, 0), pid);
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+
+  const auto view = argparse::ArgumentView::Map(fd);
+  ::close(fd);
+  EXPECT_EQ(view["--tags"].Get(0), "a");
+}
+#endif
+
+#if defined(ARGPARSE_INSTRUMENTATION)
+struct ParseCost {
+  std::size_t operations = 0;
+  std::size_t allocations = 0;
+};
+
+// Cost of a parse once the per-thread buffers are warm
+static ParseCost MeasureParse(argparse::ArgumentParser &parser,
+                              const std::vector<std::string> &args) {
+  static_cast<void>(parser.Parse(args));
+
+  argparse::instrumentation::ResetOperations();
+  const std::size_t allocations_before = g_num_allocations;
+  static_cast<void>(parser.Parse(args));
+  return {argparse::instrumentation::Operations(),
+          g_num_allocations - allocations_before};
+}
+
+// Measure inputs of size n and 8n, and fail if the cost grows by more than
+// the linear 8 times plus a margin. Quadratic growth is 64 times.
+static void ExpectLinear(const std::function<ParseCost(std::size_t)> &measure) {
+  static constexpr std::size_t SMALL = 250;
+  static constexpr std::size_t GROWTH = 8;
+  static constexpr std::size_t MAX_GROWTH = GROWTH + GROWTH / 4;
+
+  const ParseCost small = measure(SMALL);
+  const ParseCost large = measure(SMALL * GROWTH);
+  EXPECT_GT(small.operations, 0);
+  EXPECT_LE(large.operations, small.operations * MAX_GROWTH);
+  EXPECT_LE(large.allocations, small.allocations * MAX_GROWTH);
+}
+
+TEST(Complexity, argc) {
+  ExpectLinear([](std::size_t n) {
+    argparse::ArgumentParser parser;
+    parser.AddPositional("files").NumArgs("*");
+    parser.AddOptional("--tags").NumArgs("+");
+
+    std::vector<std::string> args;
+    for (std::size_t i = 0; i < n; ++i) {
+      args.push_back("file-" + std::to_string(i));
+    }
+    args.push_back("--tags");
+    for (std::size_t i = 0; i < n; ++i) {
+      args.push_back("tag-" + std::to_string(i));
+    }
+    return MeasureParse(parser, args);
+  });
+}
+
+TEST(Complexity, flags) {
+  ExpectLinear([](std::size_t n) {
+    argparse::ArgumentParser parser;
+    std::vector<std::string> args;
+    for (std::size_t i = 0; i < n; ++i) {
+      const std::string flag = "--flag-" + std::to_string(i);
+      parser.AddOptional({"-f" + std::to_string(i), flag});
+      args.push_back(flag);
+      args.push_back("value");
+    }
+    return MeasureParse(parser, args);
+  });
+}
+
+TEST(Complexity, schema_flags) {
+  ExpectLinear([](std::size_t n) {
+    std::vector<std::string> flags;
+    for (std::size_t i = 0; i < n; ++i) {
+      flags.push_back("--flag-" + std::to_string(i));
+    }
+    std::vector<argparse::OptionalSpec> table;
+    for (const auto &flag : flags) {
+      table.push_back({.flags = flag, .nargs = "?"});
+    }
+
+    argparse::ArgumentParser parser;
+    parser.AddOptionals(table);
+    return MeasureParse(parser, flags);
+  });
+}
+
+TEST(Complexity, optionals_tables) {
+  ExpectLinear([](std::size_t n) {
+    argparse::ArgumentParser parser;
+    std::vector<std::string> args;
+    for (std::size_t i = 0; i < n; ++i) {
+      args.push_back("--flag-" + std::to_string(i));
+      const argparse::OptionalSpec table[] = {
+          {.flags = args.back(), .nargs = "0", .required = (i % 2 == 0)}};
+      parser.AddOptionals(table);
+    }
+    return MeasureParse(parser, args);
+  });
+}
+
+TEST(Complexity, required_optionals) {
+  ExpectLinear([](std::size_t n) {
+    argparse::ArgumentParser parser;
+    std::vector<std::string> args;
+    for (std::size_t i = 0; i < n; ++i) {
+      const std::string flag = "--required-" + std::to_string(i);
+      parser.AddOptional(flag).Required(true);
+      parser.AddOptional("--optional-" + std::to_string(i));
+      args.push_back(flag);
+      args.push_back("value");
+    }
+    return MeasureParse(parser, args);
+  });
+}
+
+TEST(Complexity, required_among_many_optionals) {
+  // The given options stay the same while the definitions grow
+  const auto measure = [](std::size_t n) {
+    argparse::ArgumentParser parser;
+    parser.AddOptional("--required").Required(true);
+    for (std::size_t i = 0; i < n; ++i) {
+      parser.AddOptional("--optional-" + std::to_string(i));
+    }
+    parser.AddOptional("--last").Required(true).Required(false);
+    return MeasureParse(parser, {"--required", "value"});
+  };
+  const ParseCost small = measure(100);
+  const ParseCost large = measure(10000);
+  EXPECT_EQ(large.operations, small.operations);
+  EXPECT_EQ(large.allocations, small.allocations);
+}
+
+TEST(Complexity, positionals_with_mixed_nargs) {
+  ExpectLinear([](std::size_t n) {
+    argparse::ArgumentParser parser;
+    std::size_t num_values = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      auto &positional = parser.AddPositional("pos-" + std::to_string(i));
+      switch (i % 4) {
+      case 0:
+        num_values += 1;
+        break;
+      case 1:
+        positional.NumArgs("?");
+        break;
+      case 2:
+        positional.NumArgs(2);
+        num_values += 2;
+        break;
+      case 3:
+        positional.NumArgs("+");
+        num_values += 1;
+        break;
+      }
+    }
+
+    const std::vector<std::string> args(num_values + 10, "value");
+    return MeasureParse(parser, args);
+  });
+}
+#endif